@@ -0,0 +1,757 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Runs uuwm.c against fake X server living in the same process. The fake
+ * keeps windows with their geometry, map state, properties and stacking
+ * order, applies requests sent through backend to them and answers
+ * queries from them. Replies arrive fake_delay_us after request on a fake
+ * clock, which advances only when uuwm waits for a reply or fake_settle()
+ * lets the event loop sleep, so results do not depend on the machine.
+ */
+#define UUWM_NO_MAIN
+#include "../uuwm.c"
+
+#define FAKE_ROOT 1
+#define FAKE_FIRST_ATOM 69 /* Predefined atoms come before */
+#define FAKE_DESTROYED 0xff /* Map state of destroyed windows */
+
+typedef struct fake_prop_t {
+    xcb_atom_t name, type;
+    uint8_t format;
+    uint32_t len; /* In format units */
+    uint8_t *data;
+    struct fake_prop_t *next;
+} fake_prop_t;
+
+typedef struct fake_win_t {
+    xcb_window_t id;
+    bool override_redirect;
+    uint8_t map_state;
+    int x, y, w, h, bw;
+    uint32_t event_mask;
+    fake_prop_t *props;
+    struct fake_win_t *below, *above; /* Siblings in stacking order */
+} fake_win_t;
+
+typedef struct {
+    unsigned int sequence;
+    unsigned long ready_us;
+    void *reply; /* NULL for BadWindow */
+} fake_reply_t;
+
+/* Windows, hashed by id. Destroyed ones are kept, see fake_lookup() */
+static fake_win_t **fake_wins = NULL;
+static int fake_nwins = 0, fake_wins_size = 0;
+static fake_win_t *fake_bottom = NULL, *fake_top = NULL;
+static xcb_window_t fake_focus = XCB_NONE;
+
+static const char **fake_atom_names = NULL;
+static int fake_natoms = 0;
+
+static fake_reply_t *fake_replies = NULL;
+static int fake_first_reply = 0, fake_nreplies = 0, fake_replies_size = 0;
+
+static uint32_t fake_sequence = 0;
+static unsigned long fake_clock_us = 0;
+static unsigned long fake_delay_us = 0; /* Round trip */
+
+/* Requests and waits seen since fake_reset() */
+static unsigned long fake_requests = 0;
+static unsigned long fake_queries = 0;
+static unsigned long fake_waits = 0; /* Blocking round trips */
+static unsigned long fake_errors = 0;
+static unsigned long fake_configures = 0;
+static uint16_t fake_configure_mask = 0; /* Of the last one */
+static unsigned long fake_restacks = 0;
+static unsigned long fake_focuses = 0;
+static unsigned long fake_events = 0;
+static char fake_last_event[32];
+static unsigned long fake_maps = 0;
+static unsigned long fake_unmaps = 0;
+static unsigned long fake_properties = 0;
+
+/* Low bits of window ids are alike, see fake_window() */
+static int
+fake_slot(xcb_window_t id)
+{
+    return (id * 2654435761u) % fake_wins_size;
+}
+
+/* Finds window, destroyed ones too */
+static fake_win_t *
+fake_lookup(xcb_window_t id)
+{
+    int i;
+    if (!fake_wins_size)
+        return NULL;
+    for (i = fake_slot(id); fake_wins[i]; i = (i + 1) % fake_wins_size)
+        if (fake_wins[i]->id == id)
+            return fake_wins[i];
+    return NULL;
+}
+
+static fake_win_t *
+fake_getwin(xcb_window_t id)
+{
+    fake_win_t *w = fake_lookup(id);
+    return w && w->map_state != FAKE_DESTROYED ? w : NULL;
+}
+
+static void
+fake_hash(fake_win_t *w)
+{
+    int i;
+    for (i = fake_slot(w->id); fake_wins[i]; i = (i + 1) % fake_wins_size)
+        ;
+    fake_wins[i] = w;
+}
+
+/* Removes window from stacking order */
+static void
+fake_unstack(fake_win_t *w)
+{
+    if (w->below)
+        w->below->above = w->above;
+    else
+        fake_bottom = w->above;
+    if (w->above)
+        w->above->below = w->below;
+    else
+        fake_top = w->below;
+    w->below = w->above = NULL;
+}
+
+/* Puts window right above sibling, or at the bottom if there is none */
+static void
+fake_stack_above(fake_win_t *w, fake_win_t *sibling)
+{
+    w->below = sibling;
+    w->above = sibling ? sibling->above : fake_bottom;
+    if (w->below)
+        w->below->above = w;
+    else
+        fake_bottom = w;
+    if (w->above)
+        w->above->below = w;
+    else
+        fake_top = w;
+}
+
+/* Creates top-level window on top of others, as client would */
+static fake_win_t *
+fake_create_window(xcb_window_t id, int x, int y, int w, int h)
+{
+    fake_win_t *win = fake_lookup(id);
+    if (win) {
+        /* Id of destroyed window is reused */
+        memset(win, 0, sizeof(fake_win_t));
+    } else if (fake_nwins * 2 >= fake_wins_size) {
+        fake_win_t **old = fake_wins;
+        int i, old_size = fake_wins_size;
+        fake_wins_size = fake_wins_size ? fake_wins_size * 2 : 64;
+        fake_wins = xalloc(sizeof(fake_win_t *) * fake_wins_size);
+        for (i = 0; i < old_size; ++i)
+            if (old[i])
+                fake_hash(old[i]);
+        free(old);
+    }
+
+    if (!win) {
+        win = xalloc(sizeof(fake_win_t));
+        win->id = id;
+        fake_hash(win);
+        fake_nwins++;
+    }
+    win->id = id;
+    win->map_state = XCB_MAP_STATE_UNMAPPED;
+    win->x = x;
+    win->y = y;
+    win->w = w;
+    win->h = h;
+    fake_stack_above(win, fake_top);
+    return win;
+}
+
+static fake_prop_t *
+fake_getprop(fake_win_t *w, xcb_atom_t name)
+{
+    fake_prop_t *p;
+    for (p = w->props; p && p->name != name; p = p->next)
+        ;
+    return p;
+}
+
+static void
+fake_delete_prop(fake_win_t *w, xcb_atom_t name)
+{
+    fake_prop_t **pp = &w->props;
+    while (*pp && (*pp)->name != name)
+        pp = &(*pp)->next;
+    if (*pp) {
+        fake_prop_t *p = *pp;
+        *pp = p->next;
+        free(p->data);
+        free(p);
+    }
+}
+
+static void
+fake_set_prop(fake_win_t *w, uint8_t mode, xcb_atom_t name, xcb_atom_t type,
+              uint8_t format, uint32_t len, const void *data)
+{
+    fake_prop_t *p = fake_getprop(w, name);
+    if (!p || mode == XCB_PROP_MODE_REPLACE || p->format != format) {
+        fake_delete_prop(w, name);
+        p = xalloc(sizeof(fake_prop_t));
+        p->name = name;
+        p->format = format;
+        p->next = w->props;
+        w->props = p;
+        mode = XCB_PROP_MODE_APPEND;
+    }
+
+    int unit = format / 8;
+    uint8_t *d = xalloc(unit * (p->len + len) + 1);
+    if (mode == XCB_PROP_MODE_APPEND) {
+        if (p->len)
+            memcpy(d, p->data, unit * p->len);
+        if (len)
+            memcpy(d + unit * p->len, data, unit * len);
+    } else {
+        if (len)
+            memcpy(d, data, unit * len);
+        if (p->len)
+            memcpy(d + unit * len, p->data, unit * p->len);
+    }
+    free(p->data);
+    p->data = d;
+    p->len += len;
+    p->type = type;
+}
+
+static void
+fake_destroy(fake_win_t *w)
+{
+    fake_unstack(w);
+    while (w->props)
+        fake_delete_prop(w, w->props->name);
+    w->map_state = FAKE_DESTROYED;
+    if (fake_focus == w->id)
+        fake_focus = XCB_NONE;
+}
+
+/* Destroys window as client would */
+static void
+fake_destroy_window(xcb_window_t id)
+{
+    fake_win_t *w = fake_getwin(id);
+    if (w)
+        fake_destroy(w);
+}
+
+/* Unmapped override-redirect window of uuwm, see request_time() */
+static void
+fake_create_time_window()
+{
+    time_window = FAKE_ROOT + 1;
+    fake_create_window(time_window, -1, -1, 1, 1)->override_redirect = true;
+}
+
+/* Frees all windows but time window, and replies */
+static void
+fake_clear()
+{
+    int i;
+    for (i = 0; i < fake_wins_size; ++i)
+        if (fake_wins[i]) {
+            if (fake_wins[i]->map_state != FAKE_DESTROYED)
+                fake_destroy(fake_wins[i]);
+            free(fake_wins[i]);
+            fake_wins[i] = NULL;
+        }
+    fake_nwins = 0;
+
+    for (i = fake_first_reply; i < fake_nreplies; ++i)
+        free(fake_replies[i].reply);
+    fake_first_reply = fake_nreplies = 0;
+
+    fake_create_time_window();
+}
+
+static uint32_t
+fake_request()
+{
+    fake_requests++;
+    return ++fake_sequence;
+}
+
+static xcb_void_cookie_t
+fake_void_request()
+{
+    xcb_void_cookie_t c = { fake_request() };
+    return c;
+}
+
+/* Queues reply to be ready after round trip */
+static unsigned int
+fake_reply(void *reply)
+{
+    if (fake_nreplies == fake_replies_size) {
+        fake_replies_size = fake_replies_size ? fake_replies_size * 2 : 64;
+        fake_replies = xrealloc(fake_replies,
+                                sizeof(fake_reply_t) * fake_replies_size);
+    }
+    fake_queries++;
+
+    fake_reply_t *r = &fake_replies[fake_nreplies++];
+    r->sequence = fake_request();
+    r->ready_us = fake_clock_us + fake_delay_us;
+    r->reply = reply;
+    if (reply)
+        ((xcb_generic_reply_t *)reply)->sequence = r->sequence;
+    return r->sequence;
+}
+
+/* Takes reply out of the queue, waiting for it if wait is set */
+static int
+fake_take_reply(unsigned int sequence, bool wait, void **reply,
+                xcb_generic_error_t **e)
+{
+    int i;
+    for (i = fake_first_reply; i < fake_nreplies; ++i)
+        if (fake_replies[i].sequence == sequence)
+            break;
+    if (i == fake_nreplies)
+        errx(1, "fake: no reply %u", sequence);
+
+    fake_reply_t *r = &fake_replies[i];
+    if (r->ready_us > fake_clock_us) {
+        if (!wait)
+            return 0;
+        fake_clock_us = r->ready_us;
+        fake_waits++;
+    }
+
+    *reply = r->reply;
+    if (!r->reply) {
+        fake_errors++;
+        if (e) {
+            *e = xalloc(sizeof(xcb_generic_error_t));
+            (*e)->error_code = XCB_WINDOW;
+            (*e)->sequence = sequence;
+        }
+    }
+
+    /* Replies are taken in order, just forget leading ones */
+    r->sequence = 0;
+    while (fake_first_reply < fake_nreplies
+           && !fake_replies[fake_first_reply].sequence)
+        fake_first_reply++;
+    if (fake_first_reply == fake_nreplies)
+        fake_first_reply = fake_nreplies = 0;
+    return 1;
+}
+
+static void *
+fake_wait_reply(unsigned int sequence, xcb_generic_error_t **e)
+{
+    void *reply;
+    if (e)
+        *e = NULL;
+    fake_take_reply(sequence, true, &reply, e);
+    return reply;
+}
+
+static xcb_void_cookie_t
+fake_configure_window(xcb_connection_t *c, xcb_window_t window, uint16_t mask,
+                      const xcb_params_configure_window_t *params)
+{
+    fake_configures++;
+    fake_configure_mask = mask;
+
+    fake_win_t *w = fake_getwin(window);
+    if (!w) {
+        fake_errors++;
+        return fake_void_request();
+    }
+
+    if (mask & XCB_CONFIG_WINDOW_X)
+        w->x = params->x;
+    if (mask & XCB_CONFIG_WINDOW_Y)
+        w->y = params->y;
+    if (mask & XCB_CONFIG_WINDOW_WIDTH)
+        w->w = params->width;
+    if (mask & XCB_CONFIG_WINDOW_HEIGHT)
+        w->h = params->height;
+    if (mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+        w->bw = params->border_width;
+
+    if (mask & XCB_CONFIG_WINDOW_STACK_MODE) {
+        fake_win_t *sibling = mask & XCB_CONFIG_WINDOW_SIBLING
+            ? fake_getwin(params->sibling) : NULL;
+        if ((mask & XCB_CONFIG_WINDOW_SIBLING) && !sibling) {
+            fake_errors++;
+            return fake_void_request();
+        }
+
+        fake_restacks++;
+        fake_unstack(w);
+        if (params->stack_mode == XCB_STACK_MODE_ABOVE)
+            fake_stack_above(w, sibling ? sibling : fake_top);
+        else if (params->stack_mode == XCB_STACK_MODE_BELOW)
+            fake_stack_above(w, sibling ? sibling->below : NULL);
+        else
+            errx(1, "fake: stack mode %d", (int)params->stack_mode);
+    }
+    return fake_void_request();
+}
+
+static xcb_void_cookie_t
+fake_set_input_focus(xcb_connection_t *c, uint8_t revert_to,
+                     xcb_window_t focus, xcb_timestamp_t time)
+{
+    fake_focuses++;
+    fake_focus = focus;
+    return fake_void_request();
+}
+
+static xcb_void_cookie_t
+fake_send_event(xcb_connection_t *c, uint8_t propagate,
+                xcb_window_t destination, uint32_t event_mask,
+                const char *event)
+{
+    fake_events++;
+    memcpy(fake_last_event, event, sizeof(fake_last_event));
+    return fake_void_request();
+}
+
+static xcb_void_cookie_t
+fake_map_window(xcb_connection_t *c, xcb_window_t window)
+{
+    fake_win_t *w = fake_getwin(window);
+    fake_maps++;
+    if (w)
+        w->map_state = XCB_MAP_STATE_VIEWABLE;
+    else
+        fake_errors++;
+    return fake_void_request();
+}
+
+static xcb_void_cookie_t
+fake_unmap_window(xcb_connection_t *c, xcb_window_t window)
+{
+    fake_win_t *w = fake_getwin(window);
+    fake_unmaps++;
+    if (w)
+        w->map_state = XCB_MAP_STATE_UNMAPPED;
+    else
+        fake_errors++;
+    return fake_void_request();
+}
+
+static xcb_void_cookie_t
+fake_change_property(xcb_connection_t *c, uint8_t mode, xcb_window_t window,
+                     xcb_atom_t property, xcb_atom_t type, uint8_t format,
+                     uint32_t data_len, const void *data)
+{
+    fake_win_t *w = fake_getwin(window);
+    fake_properties++;
+    if (w)
+        fake_set_prop(w, mode, property, type, format, data_len, data);
+    else
+        fake_errors++;
+    return fake_void_request();
+}
+
+static xcb_void_cookie_t
+fake_delete_property(xcb_connection_t *c, xcb_window_t window,
+                     xcb_atom_t property)
+{
+    fake_win_t *w = fake_getwin(window);
+    fake_properties++;
+    if (w)
+        fake_delete_prop(w, property);
+    else
+        fake_errors++;
+    return fake_void_request();
+}
+
+static xcb_void_cookie_t
+fake_change_window_attributes(xcb_connection_t *c, xcb_window_t window,
+                              uint32_t mask, const xcb_params_cw_t *params)
+{
+    fake_win_t *w = fake_getwin(window);
+    if (!w)
+        fake_errors++;
+    else if (mask & XCB_CW_EVENT_MASK)
+        w->event_mask = params->event_mask;
+    return fake_void_request();
+}
+
+static xcb_void_cookie_t
+fake_grab_server(xcb_connection_t *c)
+{
+    return fake_void_request();
+}
+
+static xcb_get_window_attributes_cookie_t
+fake_get_window_attributes(xcb_connection_t *c, xcb_window_t window)
+{
+    fake_win_t *w = fake_getwin(window);
+    xcb_get_window_attributes_reply_t *r = NULL;
+    if (w) {
+        r = xalloc(sizeof(*r));
+        r->response_type = 1;
+        r->override_redirect = w->override_redirect;
+        r->map_state = w->map_state;
+        r->your_event_mask = w->event_mask;
+    }
+    xcb_get_window_attributes_cookie_t cookie = { fake_reply(r) };
+    return cookie;
+}
+
+static xcb_get_window_attributes_reply_t *
+fake_get_window_attributes_reply(xcb_connection_t *c,
+                                 xcb_get_window_attributes_cookie_t cookie,
+                                 xcb_generic_error_t **e)
+{
+    return fake_wait_reply(cookie.sequence, e);
+}
+
+static xcb_get_geometry_cookie_t
+fake_get_geometry(xcb_connection_t *c, xcb_drawable_t drawable)
+{
+    fake_win_t *w = fake_getwin(drawable);
+    xcb_get_geometry_reply_t *r = NULL;
+    if (w) {
+        r = xalloc(sizeof(*r));
+        r->response_type = 1;
+        r->root = FAKE_ROOT;
+        r->x = w->x;
+        r->y = w->y;
+        r->width = w->w;
+        r->height = w->h;
+        r->border_width = w->bw;
+    }
+    xcb_get_geometry_cookie_t cookie = { fake_reply(r) };
+    return cookie;
+}
+
+static xcb_get_property_cookie_t
+fake_get_property(xcb_connection_t *c, uint8_t _delete, xcb_window_t window,
+                  xcb_atom_t property, xcb_atom_t type, uint32_t long_offset,
+                  uint32_t long_length)
+{
+    fake_win_t *w = fake_getwin(window);
+    fake_prop_t *p = w ? fake_getprop(w, property) : NULL;
+    xcb_get_property_reply_t *r = NULL;
+
+    if (w) {
+        /* Missing property or wrong type give no data, as on real server */
+        uint32_t size = p ? p->len * (p->format / 8) : 0;
+        uint32_t start = MIN(long_offset * 4, size);
+        uint32_t n = p && (type == XCB_GET_PROPERTY_TYPE_ANY || type == p->type)
+            ? MIN(long_length * 4, size - start) : 0;
+
+        r = xalloc(sizeof(*r) + n);
+        r->response_type = 1;
+        if (p) {
+            r->format = p->format;
+            r->type = p->type;
+            r->bytes_after = size - start - n;
+            r->value_len = n / (p->format / 8);
+            memcpy(r + 1, p->data + start, n);
+        }
+        r->length = (n + 3) / 4;
+    }
+    xcb_get_property_cookie_t cookie = { fake_reply(r) };
+    return cookie;
+}
+
+static xcb_get_property_reply_t *
+fake_get_property_reply(xcb_connection_t *c, xcb_get_property_cookie_t cookie,
+                        xcb_generic_error_t **e)
+{
+    return fake_wait_reply(cookie.sequence, e);
+}
+
+static xcb_query_tree_cookie_t
+fake_query_tree(xcb_connection_t *c, xcb_window_t window)
+{
+    xcb_query_tree_reply_t *r = NULL;
+    fake_win_t *w;
+    int n = 0;
+
+    if (window == FAKE_ROOT) {
+        for (w = fake_bottom; w; w = w->above)
+            n++;
+        r = xalloc(sizeof(*r) + sizeof(xcb_window_t) * n);
+        r->response_type = 1;
+        r->root = FAKE_ROOT;
+        r->children_len = n;
+        r->length = n;
+
+        /* Bottom to top, as on real server */
+        xcb_window_t *children = xcb_query_tree_children(r);
+        for (w = fake_bottom; w; w = w->above)
+            *children++ = w->id;
+    } else if ((w = fake_getwin(window))) {
+        r = xalloc(sizeof(*r));
+        r->response_type = 1;
+        r->root = r->parent = FAKE_ROOT;
+    }
+    xcb_query_tree_cookie_t cookie = { fake_reply(r) };
+    return cookie;
+}
+
+static xcb_query_tree_reply_t *
+fake_query_tree_reply(xcb_connection_t *c, xcb_query_tree_cookie_t cookie,
+                      xcb_generic_error_t **e)
+{
+    return fake_wait_reply(cookie.sequence, e);
+}
+
+static xcb_intern_atom_cookie_t
+fake_intern_atom(xcb_connection_t *c, uint8_t only_if_exists,
+                 uint16_t name_len, const char *name)
+{
+    int i;
+    for (i = 0; i < fake_natoms; ++i)
+        if (strlen(fake_atom_names[i]) == name_len
+            && !strncmp(fake_atom_names[i], name, name_len))
+            break;
+    if (i == fake_natoms) {
+        char *copy = xalloc(name_len + 1);
+        memcpy(copy, name, name_len);
+        fake_atom_names = xrealloc(fake_atom_names,
+                                   sizeof(char *) * ++fake_natoms);
+        fake_atom_names[i] = copy;
+    }
+
+    xcb_intern_atom_reply_t *r = xalloc(sizeof(*r));
+    r->response_type = 1;
+    r->atom = FAKE_FIRST_ATOM + i;
+    xcb_intern_atom_cookie_t cookie = { fake_reply(r) };
+    return cookie;
+}
+
+static xcb_intern_atom_reply_t *
+fake_intern_atom_reply(xcb_connection_t *c, xcb_intern_atom_cookie_t cookie,
+                       xcb_generic_error_t **e)
+{
+    return fake_wait_reply(cookie.sequence, e);
+}
+
+static int
+fake_poll_for_reply(xcb_connection_t *c, unsigned int request, void **reply,
+                    xcb_generic_error_t **error)
+{
+    *error = NULL;
+    return fake_take_reply(request, false, reply, error);
+}
+
+static const backend_t fake_backend = {
+    fake_configure_window,
+    fake_set_input_focus,
+    fake_send_event,
+    fake_map_window,
+    fake_unmap_window,
+    fake_change_property,
+    fake_delete_property,
+    fake_change_window_attributes,
+    fake_grab_server,
+    fake_grab_server,
+    fake_get_window_attributes,
+    fake_get_window_attributes_reply,
+    fake_get_geometry,
+    fake_get_property,
+    fake_get_property_reply,
+    fake_query_tree,
+    fake_query_tree_reply,
+    fake_intern_atom,
+    fake_intern_atom_reply,
+    fake_poll_for_reply,
+};
+
+static void
+fake_reset()
+{
+    fake_requests = fake_queries = fake_waits = fake_errors = 0;
+    fake_configures = fake_restacks = fake_focuses = fake_events = 0;
+    fake_configure_mask = 0;
+    fake_maps = fake_unmaps = fake_properties = 0;
+}
+
+/*
+ * Lets event loop sleep until all replies are here and finishes managing
+ * windows, as run() would.
+ */
+static void
+fake_settle()
+{
+    do {
+        int i;
+        for (i = fake_first_reply; i < fake_nreplies; ++i)
+            fake_clock_us = MAX(fake_clock_us, fake_replies[i].ready_us);
+    } while (manage_pending());
+}
+
+/* Sets up 600x800 screen, atoms and time window as setup() would */
+static void
+fake_setup()
+{
+    static xcb_screen_t fake_screen;
+
+    fake_screen.root = FAKE_ROOT;
+    fake_screen.width_in_pixels = 600;
+    fake_screen.height_in_pixels = 800;
+    screen = &fake_screen;
+    backend = &fake_backend;
+
+    intern_atoms(AtomLast, atom, atom_names);
+    fake_create_time_window();
+
+    sx = sy = 0;
+    sw = fake_screen.width_in_pixels;
+    sh = fake_screen.height_in_pixels;
+    updategeom();
+    fake_reset();
+}
+
+/* Window ids spread over several X clients, as in real session */
+static xcb_window_t
+fake_window(int i)
+{
+    return ((i % 37 + 1) << 21) | (i / 37 + 1);
+}
+
+/* Maps window as client would: it is left to window manager */
+static void
+fake_map_request(xcb_window_t w)
+{
+    xcb_map_request_event_t e;
+
+    memset(&e, 0, sizeof(e));
+    e.response_type = XCB_MAP_REQUEST;
+    e.parent = FAKE_ROOT;
+    e.window = w;
+    maprequest(NULL, conn, &e);
+}
+
+/* Creates and maps window, returns client once it is managed */
+static client_t *
+fake_client(xcb_window_t w)
+{
+    fake_create_window(w, 0, 0, 100, 100);
+    fake_map_request(w);
+    fake_settle();
+    return getclient(w);
+}
+
+/* Unmanages all clients and forgets all windows */
+static void
+fake_free_clients()
+{
+    while (clients)
+        unmanage(clients, false);
+    fake_clear();
+}
@@ -0,0 +1,44 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Measures focus() cost as number of clients grows from 10 to 10000. The
+ * bottom client is focused each time, cycling through all of them, so it
+ * has to be moved across the whole stack.
+ */
+#include "fake.h"
+
+#define FOCUSES 1000000
+
+int
+main()
+{
+    static const int sizes[] = { 10, 100, 1000, 10000 };
+    int s;
+
+    fake_setup();
+    printf("%8s %12s %18s\n", "clients", "focus, ns", "requests/focus");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        int n = sizes[s], i;
+        client_t *bottom;
+
+        for (i = 0; i < n; ++i)
+            fake_client(fake_window(i));
+        for (bottom = stack; bottom->snext; bottom = bottom->snext)
+            ;
+
+        fake_reset();
+        unsigned long start = now_us();
+        for (i = 0; i < FOCUSES; ++i) {
+            client_t *next = bottom->sprev;
+            focus(bottom);
+            bottom = next;
+        }
+        double focus_ns = (now_us() - start) * 1000.0 / FOCUSES;
+
+        printf("%8d %12.1f %18.2f\n", n, focus_ns,
+               (double)(fake_focuses + fake_events) / FOCUSES);
+
+        fake_free_clients();
+    }
+    return 0;
+}
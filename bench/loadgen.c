@@ -0,0 +1,186 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Load generator for benchmarking uuwm: creates, maps, raises, retitles and
+ * destroys N windows, measuring time from MapWindow and from raise request
+ * to FocusIn on the window expected to be focused.
+ *
+ * usage: loadgen [-t] N
+ *     -t  every other window is a transient of the previous one
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <poll.h>
+#include <time.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcb_atom.h>
+
+#define FOCUS_TIMEOUT_MS 5000
+
+static xcb_connection_t *conn;
+
+static unsigned long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+}
+
+static void *
+xalloc(size_t size)
+{
+    void *res = calloc(1, size);
+    if (!res)
+        err(1, "Unable to alloc %lu bytes", (unsigned long)size);
+    return res;
+}
+
+static int
+cmp_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Takes sorted values */
+static unsigned long
+percentile(const unsigned long *v, int n, int p)
+{
+    return n ? v[(n - 1) * p / 100] : 0;
+}
+
+/* Waits for all sent requests to be processed, drops queued events */
+static void
+sync_drain()
+{
+    xcb_generic_event_t *e;
+
+    free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+    while ((e = xcb_poll_for_event(conn)))
+        free(e);
+}
+
+/* Waits for FocusIn on window. Returns false on timeout. */
+static bool
+wait_focus(xcb_window_t w)
+{
+    unsigned long deadline = now_us() + FOCUS_TIMEOUT_MS * 1000ul;
+    struct pollfd pfd = { .fd = xcb_get_file_descriptor(conn),
+                          .events = POLLIN };
+
+    xcb_flush(conn);
+    for (;;) {
+        xcb_generic_event_t *e;
+        while ((e = xcb_poll_for_event(conn))) {
+            bool focused = (e->response_type & ~0x80) == XCB_FOCUS_IN
+                && ((xcb_focus_in_event_t *)e)->event == w;
+            free(e);
+            if (focused)
+                return true;
+        }
+        if (xcb_connection_has_error(conn))
+            errx(1, "connection to X server has been lost");
+
+        unsigned long now = now_us();
+        if (now >= deadline)
+            return false;
+        poll(&pfd, 1, (deadline - now) / 1000 + 1);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    bool transients = false;
+    int n, i;
+
+    if (argc == 3 && !strcmp(argv[1], "-t")) {
+        transients = true;
+        argv++;
+        argc--;
+    }
+    if (argc != 2 || (n = atoi(argv[1])) < 1)
+        errx(1, "usage: loadgen [-t] N");
+
+    conn = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(conn))
+        errx(1, "cannot open display %s",
+             getenv("DISPLAY") ? getenv("DISPLAY") : "<NULL>");
+    xcb_screen_t *screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+
+    xcb_window_t *wins = xalloc(sizeof(xcb_window_t) * n);
+    unsigned long *map_us = xalloc(sizeof(unsigned long) * n);
+    unsigned long *raise_us = xalloc(sizeof(unsigned long) * n);
+    int nmap = 0, nraise = 0, nraises = 0, timeouts = 0;
+    unsigned long start = now_us(), t;
+
+    /* Newly mapped window, transient or not, gets focus */
+    for (i = 0; i < n; ++i) {
+        uint32_t mask = XCB_EVENT_MASK_FOCUS_CHANGE;
+
+        wins[i] = xcb_generate_id(conn);
+        xcb_create_window(conn, XCB_COPY_FROM_PARENT, wins[i], screen->root,
+                          0, 0, 100, 100, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                          screen->root_visual, XCB_CW_EVENT_MASK, &mask);
+        if (transients && i % 2)
+            xcb_change_property(conn, XCB_PROP_MODE_REPLACE, wins[i],
+                                WM_TRANSIENT_FOR, WINDOW, 32, 1, &wins[i - 1]);
+
+        t = now_us();
+        xcb_map_window(conn, wins[i]);
+        if (wait_focus(wins[i]))
+            map_us[nmap++] = now_us() - t;
+        else
+            timeouts++;
+    }
+
+    /* Window at the bottom, along with its transient, is raised each time,
+     * so every raise moves focus. Top one can't be raised with effect. */
+    sync_drain();
+    int step = transients ? 2 : 1;
+    for (i = 0; n > step && i < n; i += step) {
+        xcb_window_t top = i + step - 1 < n ? wins[i + step - 1] : wins[i];
+        uint32_t above = XCB_STACK_MODE_ABOVE;
+
+        t = now_us();
+        xcb_configure_window(conn, wins[i], XCB_CONFIG_WINDOW_STACK_MODE,
+                             &above);
+        nraises++;
+        if (wait_focus(top))
+            raise_us[nraise++] = now_us() - t;
+        else
+            timeouts++;
+    }
+
+    for (i = 0; i < n; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "loadgen %d", i);
+        xcb_change_property(conn, XCB_PROP_MODE_REPLACE, wins[i], WM_NAME,
+                            STRING, 8, strlen(name), name);
+    }
+    for (i = 0; i < n; ++i)
+        xcb_destroy_window(conn, wins[i]);
+    sync_drain();
+
+    unsigned long total_us = now_us() - start;
+    qsort(map_us, nmap, sizeof(unsigned long), cmp_ulong);
+    qsort(raise_us, nraise, sizeof(unsigned long), cmp_ulong);
+
+    /* Create and map, raise, retitle, destroy */
+    printf("%5d %-9s map %6lu/%6lu us, raise %6lu/%6lu us (p50/p99), "
+           "%8.0f ops/s, %d timeouts\n",
+           n, transients ? "transient" : "plain",
+           percentile(map_us, nmap, 50), percentile(map_us, nmap, 99),
+           percentile(raise_us, nraise, 50), percentile(raise_us, nraise, 99),
+           (3.0 * n + nraises) * 1000000 / total_us, timeouts);
+
+    xcb_disconnect(conn);
+    return timeouts != 0;
+}
@@ -0,0 +1,44 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Measures getclient() cost, for hits and misses, as number of clients
+ * grows from 10 to 10000. It is expected to stay flat.
+ */
+#include "fake.h"
+
+#define LOOKUPS 1000000
+
+int
+main()
+{
+    static const int sizes[] = { 10, 100, 1000, 10000 };
+    int s;
+
+    fake_setup();
+    printf("%8s %12s %12s\n", "clients", "hit, ns", "miss, ns");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        int n = sizes[s], i;
+        unsigned long found = 0, start;
+
+        for (i = 0; i < n; ++i)
+            fake_client(fake_window(i));
+
+        /* Stride visits clients out of insertion order */
+        start = now_us();
+        for (i = 0; i < LOOKUPS; ++i)
+            found += getclient(fake_window(i * 7919ul % n)) != NULL;
+        double hit_ns = (now_us() - start) * 1000.0 / LOOKUPS;
+
+        start = now_us();
+        for (i = 0; i < LOOKUPS; ++i)
+            found += getclient(fake_window(n + i % n)) != NULL;
+        double miss_ns = (now_us() - start) * 1000.0 / LOOKUPS;
+
+        if (found != LOOKUPS)
+            errx(1, "%lu of %d lookups succeeded", found, LOOKUPS);
+        printf("%8d %12.1f %12.1f\n", n, hit_ns, miss_ns);
+
+        fake_free_clients();
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Counts requests and blocking round trips of scan(), manage() and raising
+ * clients, for 10 to 10000 windows every fourth of which is transient for
+ * the one before. Time is fake: replies take given round trip (1 ms by
+ * default) and nothing else takes any, so results are exactly repeatable.
+ */
+#include "fake.h"
+
+/* Creates windows as clients would, every fourth one transient */
+static void
+create_windows(int first, int n)
+{
+    int i;
+    for (i = first; i < first + n; ++i) {
+        fake_win_t *w = fake_create_window(fake_window(i), 0, 0, 100, 100);
+        if (i % 4 == 3) {
+            xcb_window_t parent = fake_window(i - 1);
+            fake_set_prop(w, XCB_PROP_MODE_REPLACE, WM_TRANSIENT_FOR, WINDOW,
+                          32, 1, &parent);
+        }
+    }
+}
+
+/* Checks that server stacking order is the focus stack */
+static void
+check_stacking()
+{
+    fake_win_t *w = fake_top;
+    client_t *c;
+
+    /* Override-redirect windows are not managed */
+    for (c = stack; c; c = c->snext, w = w->below) {
+        while (w && w->override_redirect)
+            w = w->below;
+        if (!w || w->id != c->win)
+            errx(1, "server stacking order differs from focus stack");
+    }
+    for (; w; w = w->below)
+        if (!w->override_redirect)
+            errx(1, "unmanaged window %x left on server", w->id);
+    if (fake_errors)
+        errx(1, "%lu requests failed", fake_errors);
+}
+
+static void
+report(int n)
+{
+    printf(" %9.2f %6lu %9.1f", (double)fake_requests / n, fake_waits,
+           fake_clock_us / 1000.0);
+}
+
+/* Raises each client once, bottom one first, as asked by its client */
+static void
+raise_all(int n)
+{
+    xcb_configure_request_event_t e;
+    int i;
+
+    memset(&e, 0, sizeof(e));
+    e.response_type = XCB_CONFIGURE_REQUEST;
+    e.parent = FAKE_ROOT;
+    e.value_mask = XCB_CONFIG_WINDOW_STACK_MODE;
+    e.stack_mode = XCB_STACK_MODE_ABOVE;
+
+    for (i = 0; i < n; ++i) {
+        client_t *bottom;
+        for (bottom = stack; bottom->snext; bottom = bottom->snext)
+            ;
+        e.window = bottom->win;
+        configurerequest(NULL, conn, &e);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const int sizes[] = { 10, 100, 1000, 10000 };
+    int s;
+
+    if (argc == 3 && !strcmp(argv[1], "-d"))
+        fake_delay_us = strtoul(argv[2], NULL, 10);
+    else if (argc == 1)
+        fake_delay_us = 1000;
+    else
+        errx(1, "usage: manage [-d round-trip-us]");
+
+    fake_setup();
+    printf("round trip %lu us; per operation: requests, blocking round trips,"
+           " ms\n", fake_delay_us);
+    printf("%8s %27s %27s %27s\n", "clients", "scan", "manage", "raise");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        int n = sizes[s], i;
+
+        printf("%8d", n);
+
+        /* Windows mapped before uuwm started */
+        create_windows(0, n);
+        for (i = 0; i < n; ++i)
+            fake_getwin(fake_window(i))->map_state = XCB_MAP_STATE_VIEWABLE;
+        fake_reset();
+        fake_clock_us = 0;
+        scan();
+        fake_settle();
+        report(n);
+        check_stacking();
+
+        /* Burst of new windows */
+        create_windows(n, n);
+        fake_reset();
+        fake_clock_us = 0;
+        for (i = n; i < 2 * n; ++i)
+            fake_map_request(fake_window(i));
+        fake_settle();
+        report(n);
+        check_stacking();
+
+        fake_reset();
+        fake_clock_us = 0;
+        raise_all(n);
+        report(n);
+        check_stacking();
+
+        printf("\n");
+        fake_free_clients();
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Runs bench/loadgen against uuwm on a private Xvfb server, for each number
+# of windows given (1 to 5000 by default), without and with transients.
+#
+# usage: bench/run.sh [N...]
+#
+# BENCH_DISPLAY selects display number (99 by default). Environment is
+# passed to uuwm, so e.g. UUWM_STATS can be set.
+
+cd "$(dirname "$0")" || exit 1
+
+DISPLAY=:${BENCH_DISPLAY:-99}
+export DISPLAY
+
+Xvfb $DISPLAY -screen 0 800x600x16 -nolisten tcp >/dev/null 2>&1 &
+xvfb=$!
+uuwm=
+trap 'kill $uuwm $xvfb 2>/dev/null' EXIT INT TERM
+
+tries=0
+while [ ! -S /tmp/.X11-unix/X${DISPLAY#:} ]; do
+    tries=$((tries + 1))
+    if [ $tries -gt 50 ] || ! kill -0 $xvfb 2>/dev/null; then
+        echo "Xvfb has not started on $DISPLAY" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+../uuwm &
+uuwm=$!
+sleep 0.5
+
+status=0
+for n in ${*:-1 10 100 1000 5000}; do
+    ./loadgen $n || status=1
+    ./loadgen -t $n || status=1
+done
+
+if [ -n "$UUWM_STATS" ]; then
+    kill -USR1 $uuwm
+    sleep 0.2
+fi
+exit $status
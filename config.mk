@@ -6,10 +6,18 @@ VERSION = 0.1
 # paths
 PREFIX = /usr/local
 
+# XDamage repaint monitoring, uncomment if you want it
+#XDAMAGELIBS = xcb-damage
+#XDAMAGEFLAGS = -DXDAMAGE
+
+# X-Resource memory accounting, uncomment if you want it
+#XRESLIBS = xcb-res
+#XRESFLAGS = -DXRES
+
 # libs
-L=xcb xcb-aux xcb-atom xcb-icccm
+L=xcb xcb-aux xcb-atom xcb-icccm ${XDAMAGELIBS} ${XRESLIBS}
 
 # flags
-CPPFLAGS = -DVERSION=\"${VERSION}\"
+CPPFLAGS = -DVERSION=\"${VERSION}\" ${XDAMAGEFLAGS} ${XRESFLAGS}
 CFLAGS = -std=c99 -pedantic -Wall -O0 -g $(CPPFLAGS) $(foreach lib,$(L),$(shell pkg-config --cflags $(lib)))
 LDFLAGS = $(foreach lib,$(L),$(shell pkg-config --libs $(lib)))
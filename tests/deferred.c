@@ -0,0 +1,84 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Checks deferred raise (UUWM_MAP_DELAY): window which goes away before
+ * its raise causes no damage, and transient raised along with its parent
+ * is not raised again by its own timer.
+ */
+#include "../bench/fake.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            warnx("%s:%d: %s", __FILE__, __LINE__, #cond);              \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static client_t *
+deferred_client(xcb_window_t w, xcb_window_t parent)
+{
+    fake_win_t *win = fake_create_window(w, 0, 0, 100, 100);
+    if (parent != XCB_NONE)
+        fake_set_prop(win, XCB_PROP_MODE_REPLACE, WM_TRANSIENT_FOR, WINDOW,
+                      32, 1, &parent);
+    fake_map_request(w);
+    fake_settle();
+    return getclient(w);
+}
+
+static void
+test_splash()
+{
+    client_t *c = deferred_client(fake_window(1), XCB_NONE);
+    CHECK(c && c->raise_timeout.armed);
+    CHECK(damage.n == 0);
+
+    unmanage(c, true);
+    CHECK(damage.n == 0);
+    CHECK(raises_suppressed == 1);
+
+    /* Raised one is damaged whole */
+    c = deferred_client(fake_window(2), XCB_NONE);
+    canceltimeout(&c->raise_timeout);
+    deferred_raise(c);
+    CHECK(damage.n == 1 && damage.rects[0].width == ww);
+    CHECK(stack == c && fake_focus == c->win);
+
+    damage.n = 0;
+    fake_free_clients();
+}
+
+static void
+test_group()
+{
+    client_t *p = deferred_client(fake_window(1), XCB_NONE);
+    client_t *t = deferred_client(fake_window(2), p->win);
+    CHECK(t->parent == p);
+
+    canceltimeout(&p->raise_timeout);
+    deferred_raise(p);
+    CHECK(!t->raise_timeout.armed);
+    CHECK(stack == t && t->snext == p);
+    CHECK(fake_focus == t->win);
+
+    damage.n = 0;
+    fake_free_clients();
+}
+
+int
+main()
+{
+    fake_setup();
+    map_delay_ms = 1000;
+    track_damage = true;
+
+    test_splash();
+    test_group();
+
+    if (failures)
+        errx(1, "deferred: %d checks failed", failures);
+    printf("deferred: ok\n");
+    return 0;
+}
@@ -0,0 +1,196 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Counts requests sent when arranging clients and answering their
+ * ConfigureRequests: ConfigureWindow only with fields really changed,
+ * synthetic ConfigureNotify exactly when ICCCM 4.1.5 asks for it. Checks
+ * that geometry passed through before window is managed is not lost.
+ */
+#include "../bench/fake.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            warnx("%s:%d: %s", __FILE__, __LINE__, #cond);              \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static void
+request(client_t *c, uint16_t mask, int x, int y, int w, int h, int bw)
+{
+    xcb_configure_request_event_t e;
+
+    memset(&e, 0, sizeof(e));
+    e.response_type = XCB_CONFIGURE_REQUEST;
+    e.parent = screen->root;
+    e.window = c->win;
+    e.value_mask = mask;
+    e.x = x;
+    e.y = y;
+    e.width = w;
+    e.height = h;
+    e.border_width = bw;
+
+    fake_reset();
+    configurerequest(NULL, conn, &e);
+}
+
+static void
+test_arrange()
+{
+    client_t *c = fake_client(fake_window(1));
+
+    /* Already at layout geometry */
+    fake_reset();
+    arrange(c);
+    CHECK(fake_configures == 0);
+    CHECK(fake_events == 0);
+
+    /* Moved only: synthetic event tells the client */
+    c->x = 10;
+    fake_reset();
+    arrange(c);
+    CHECK(fake_configures == 1);
+    CHECK(fake_configure_mask == XCB_CONFIG_WINDOW_X);
+    CHECK(fake_events == 1);
+
+    /* Resized: real ConfigureNotify is enough */
+    c->h = 10;
+    c->bw = 2;
+    fake_reset();
+    arrange(c);
+    CHECK(fake_configures == 1);
+    CHECK(fake_configure_mask == (XCB_CONFIG_WINDOW_HEIGHT
+                                  | XCB_CONFIG_WINDOW_BORDER_WIDTH));
+    CHECK(fake_events == 0);
+    CHECK(c->h == wh && c->bw == 0);
+
+    fake_free_clients();
+}
+
+static void
+test_rejected()
+{
+    client_t *c = fake_client(fake_window(1));
+
+    /* Tiled client keeps layout geometry, request is only answered */
+    request(c, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+            0, 0, 100, 100, 0);
+    CHECK(fake_configures == 0);
+    CHECK(fake_events == 1);
+    CHECK(c->w == ww && c->h == wh);
+
+    request(c, XCB_CONFIG_WINDOW_BORDER_WIDTH, 0, 0, 0, 0, 5);
+    CHECK(fake_configures == 0);
+    CHECK(fake_events == 1);
+
+    /* Identical repeat just after the answer is answered later, once */
+    request(c, XCB_CONFIG_WINDOW_BORDER_WIDTH, 0, 0, 0, 0, 5);
+    CHECK(fake_configures == 0);
+    CHECK(fake_events == 0);
+    CHECK(c->synthetic_timeout.armed);
+    request(c, XCB_CONFIG_WINDOW_BORDER_WIDTH, 0, 0, 0, 0, 5);
+    CHECK(fake_events == 0);
+
+    canceltimeout(&c->synthetic_timeout);
+    fake_free_clients();
+}
+
+static void
+test_floating()
+{
+    client_t *c = fake_client(fake_window(1));
+    c->is_floating = true;
+
+    /* Move within window area */
+    request(c, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, 20, 30, 0, 0, 0);
+    CHECK(fake_configures == 1);
+    CHECK(fake_configure_mask == (XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y));
+    CHECK(fake_events == 1);
+
+    /* Resize, width unchanged */
+    request(c, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+            0, 0, c->w, 100, 0);
+    CHECK(fake_configures == 1);
+    CHECK(fake_configure_mask == XCB_CONFIG_WINDOW_HEIGHT);
+    CHECK(fake_events == 0);
+
+    /* Moved out of window area, clamped back */
+    request(c, XCB_CONFIG_WINDOW_X, -50, 0, 0, 0, 0);
+    CHECK(fake_configures == 1);
+    CHECK(fake_configure_mask == XCB_CONFIG_WINDOW_X);
+    CHECK(c->x == wx);
+    CHECK(fake_events == 1);
+
+    fake_free_clients();
+}
+
+static void
+test_updategeom()
+{
+    int i;
+    for (i = 0; i < 10; ++i)
+        fake_client(fake_window(i));
+
+    fake_reset();
+    sh = 600;
+    updategeom();
+    CHECK(fake_configures == 10);
+    CHECK(fake_configure_mask == XCB_CONFIG_WINDOW_HEIGHT);
+    CHECK(fake_events == 0);
+
+    fake_reset();
+    updategeom();
+    CHECK(fake_configures == 0);
+    CHECK(fake_events == 0);
+
+    sh = screen->height_in_pixels;
+    updategeom();
+    fake_free_clients();
+}
+
+/* Request passed through while waiting for replies is not lost */
+static void
+test_pending()
+{
+    xcb_window_t w = fake_window(1);
+    fake_win_t *win = fake_create_window(w, wx, wy, ww, wh);
+    xcb_configure_request_event_t e;
+
+    fake_map_request(w);
+
+    memset(&e, 0, sizeof(e));
+    e.response_type = XCB_CONFIGURE_REQUEST;
+    e.parent = screen->root;
+    e.window = w;
+    e.value_mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+    e.width = 100;
+    e.height = 100;
+    configurerequest(NULL, conn, &e);
+    CHECK(win->w == 100 && win->h == 100);
+
+    /* GetGeometry reply still has layout geometry */
+    fake_settle();
+    CHECK(win->w == ww && win->h == wh);
+
+    fake_free_clients();
+}
+
+int
+main()
+{
+    fake_setup();
+
+    test_arrange();
+    test_rejected();
+    test_floating();
+    test_updategeom();
+    test_pending();
+
+    if (failures)
+        errx(1, "geometry: %d checks failed", failures);
+    printf("geometry: ok\n");
+    return 0;
+}
@@ -0,0 +1,69 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Checks that WM_TAKE_FOCUS carries latest server time seen without
+ * waiting for a fresh one, and that a fresh one is asked for afterwards.
+ */
+#include "../bench/fake.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            warnx("%s:%d: %s", __FILE__, __LINE__, #cond);              \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static void
+test_take_focus()
+{
+    xcb_window_t w = fake_window(1);
+    fake_win_t *win = fake_create_window(w, 0, 0, 100, 100);
+    xcb_atom_t protocols[] = { atom[WMTakeFocus] };
+    uint32_t hints[9] = { 1 /* InputHint */, 0 /* no input */ };
+
+    fake_set_prop(win, XCB_PROP_MODE_REPLACE, atom[WMProtocols], ATOM, 32,
+                  1, protocols);
+    fake_set_prop(win, XCB_PROP_MODE_REPLACE, WM_HINTS, WM_HINTS, 32, 9,
+                  hints);
+    fake_map_request(w);
+    fake_settle();
+    client_t *c = getclient(w);
+    CHECK(c && c->take_focus && !c->accepts_input);
+
+    xcb_property_notify_event_t e;
+    memset(&e, 0, sizeof(e));
+    e.response_type = XCB_PROPERTY_NOTIFY;
+    e.window = time_window;
+    e.atom = atom[UUWMTimestamp];
+    e.time = 1234;
+    note_time((xcb_generic_event_t *)&e);
+
+    fake_delete_prop(fake_getwin(time_window), atom[UUWMTimestamp]);
+    fake_reset();
+    give_focus(c);
+
+    xcb_client_message_event_t *m
+        = (xcb_client_message_event_t *)fake_last_event;
+    CHECK(fake_waits == 0);
+    CHECK(m->response_type == XCB_CLIENT_MESSAGE && m->window == w);
+    CHECK(m->data.data32[0] == atom[WMTakeFocus]);
+    CHECK(m->data.data32[1] == 1234);
+    CHECK(fake_getprop(fake_getwin(time_window), atom[UUWMTimestamp]));
+
+    fake_free_clients();
+}
+
+int
+main()
+{
+    fake_setup();
+
+    test_take_focus();
+
+    if (failures)
+        errx(1, "timestamp: %d checks failed", failures);
+    printf("timestamp: ok\n");
+    return 0;
+}
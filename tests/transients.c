@@ -0,0 +1,86 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Checks that transients managed before their parent are adopted by it,
+ * again after the parent is withdrawn and mapped back, and that raising
+ * parent restacks its transients above it on the server.
+ */
+#include "../bench/fake.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            warnx("%s:%d: %s", __FILE__, __LINE__, #cond);              \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static client_t *
+transient(xcb_window_t w, xcb_window_t parent)
+{
+    fake_win_t *win = fake_create_window(w, 0, 0, 100, 100);
+    fake_set_prop(win, XCB_PROP_MODE_REPLACE, WM_TRANSIENT_FOR, WINDOW, 32,
+                  1, &parent);
+    fake_map_request(w);
+    fake_settle();
+    return getclient(w);
+}
+
+static void
+test_adopt()
+{
+    xcb_window_t pw = fake_window(1);
+
+    client_t *t = transient(fake_window(2), pw);
+    CHECK(t && !t->parent && !t->is_floating);
+    CHECK(norphans == 1);
+
+    client_t *p = fake_client(pw);
+    CHECK(p && t->parent == p && t->is_floating);
+    CHECK(p->transients == t);
+    CHECK(norphans == 0);
+
+    /* Withdrawn parent leaves transient waiting for it */
+    unmanage(p, false);
+    CHECK(!t->parent);
+    CHECK(norphans == 1);
+
+    fake_map_request(pw);
+    fake_settle();
+    p = getclient(pw);
+    CHECK(p && t->parent == p);
+    CHECK(norphans == 0);
+
+    fake_free_clients();
+    CHECK(norphans == 0);
+}
+
+static void
+test_raise()
+{
+    client_t *p = fake_client(fake_window(1));
+    client_t *t = transient(fake_window(2), p->win);
+    fake_client(fake_window(3));
+
+    raiseclient(p);
+    CHECK(stack == t && t->snext == p);
+    CHECK(fake_top->id == t->win && fake_top->below->id == p->win);
+    CHECK(fake_focus == t->win);
+
+    fake_free_clients();
+}
+
+int
+main()
+{
+    fake_setup();
+
+    test_adopt();
+    test_raise();
+
+    if (failures)
+        errx(1, "transients: %d checks failed", failures);
+    printf("transients: ok\n");
+    return 0;
+}
@@ -19,44 +19,274 @@
  * - NetWM support for docks
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xcb_aux.h>
 #include <xcb/xcb_atom.h>
 #include <xcb/xcb_icccm.h>
 #include <xcb/xcb_event.h>
+#ifdef XDAMAGE
+#include <xcb/damage.h>
+#endif
+#ifdef XRES
+#include <xcb/res.h>
+#endif
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+/* Callback to be called at given time, see settimeout() */
+typedef struct timeout_t {
+    unsigned long when; /* now_us() */
+    void (*fn)(void *arg);
+    void *arg;
+    bool armed;
+    struct timeout_t *next;
+} timeout_t;
+
+#ifdef XDAMAGE
+/* Client repaints over the last REPAINT_SECONDS, by second */
+#define REPAINT_SECONDS 10
+
+typedef struct {
+    unsigned long sec; /* Second of the latest bucket */
+    unsigned long events[REPAINT_SECONDS];
+    unsigned long area[REPAINT_SECONDS];
+} repaint_t;
+#endif
+
+#ifdef XRES
+/* Server-side memory samples of client, oldest first */
+#define XRES_HISTORY 8
+
+typedef struct {
+    unsigned long when; /* Seconds */
+    uint64_t pixmap_bytes;
+    uint32_t resources;
+} xres_sample_t;
+#endif
+
+/* Process owning one or more clients, known from _NET_WM_PID */
+typedef struct proc_t {
+    pid_t pid;
+    int nclients;
+    int nvisible;     /* Clients not obscured */
+    bool never_freeze;
+    bool is_frozen;   /* Stopped by uuwm */
+    bool is_boosted;  /* Moved or reniced by uuwm, see set_boost() */
+    int orig_nice;
+    char *orig_cgroup;
+    timeout_t freeze_timeout;
+    struct proc_t *next;
+} proc_t;
+
+/* Window geometry, including border width */
+typedef struct {
+    int x, y, w, h;
+    int bw;
+} geom_t;
+
 typedef struct client_t {
     xcb_window_t win;
-    int x, y, w, h;
 
+    /* Geometry last committed to X server */
+    int x, y, w, h;
     int bw;
     int oldbw; /* To be restored on WM exit */
 
     bool is_floating;
 
-    struct client_t *next;
-    struct client_t *snext;
+    proc_t *proc;
+
+    timeout_t raise_timeout; /* Deferred raise of newly managed client */
+
+#ifdef XDAMAGE
+    xcb_damage_damage_t damage;
+    repaint_t repaint;
+#endif
+
+#ifdef XRES
+    xres_sample_t xres[XRES_HISTORY];
+    int nxres;
+#endif
+
+    bool can_delete;  /* WM_DELETE_WINDOW is in WM_PROTOCOLS */
+    bool take_focus;  /* WM_TAKE_FOCUS is in WM_PROTOCOLS */
+    bool accepts_input; /* Input field of WM_HINTS */
+    bool close_requested; /* Asked to close on low memory */
+
+    /* Focus taken while another client was on top of stack */
+    unsigned long steals;
+    unsigned int steal_streak;   /* Steals in quick succession */
+    unsigned long last_steal_us;
+
+    /* Last ConfigureRequest undone by layout, and geometry it was answered
+     * with. Identical requests get the same answer without reconfiguring. */
+    bool has_rejected;
+    xcb_configure_request_event_t rejected;
+    xcb_rectangle_t rejected_rect;
+    int rejected_bw;
+    unsigned long configure_requests;
+    unsigned long configure_cached;
+
+    /* Synthetic ConfigureNotify answering cached requests is rate-limited */
+    unsigned long last_synthetic_us;
+    timeout_t synthetic_timeout;
+
+    bool is_obscured; /* Covered by a non-floating client above */
+    bool is_iconic;   /* Unmapped by uuwm as obscured */
+    int ignore_unmap; /* UnmapNotify events caused by uuwm */
+
+    /* WM_TRANSIENT_FOR and client it points to, if managed. Transients of
+     * client are kept in focus stack order, bottom first. */
+    xcb_window_t transient_for;
+    struct client_t *parent;
+    struct client_t *transients, *transients_top;
+    struct client_t *tprev, *tnext;
+
+    struct client_t *prev, *next;   /* clients list */
+    struct client_t *sprev, *snext; /* focus stack */
 } client_t;
 
 static xcb_connection_t *conn;
 static xcb_screen_t *screen;
 
+/*
+ * Latest server time seen in events. Unmapped time window is appended to
+ * after it is used, so the next PropertyNotify on it brings a fresh one.
+ */
+static xcb_timestamp_t last_time = XCB_CURRENT_TIME;
+static xcb_window_t time_window;
+
+/*
+ * Requests about windows, focus and properties, their replies and atoms are
+ * sent through backend, so tests and benchmarks can run against fake server
+ * (see bench/fake.h). Setup checks and extension requests go to xcb
+ * directly.
+ */
+typedef struct {
+    xcb_void_cookie_t (*configure_window)(xcb_connection_t *c,
+                                          xcb_window_t window, uint16_t mask,
+                                          const xcb_params_configure_window_t *params);
+    xcb_void_cookie_t (*set_input_focus)(xcb_connection_t *c, uint8_t revert_to,
+                                         xcb_window_t focus,
+                                         xcb_timestamp_t time);
+    xcb_void_cookie_t (*send_event)(xcb_connection_t *c, uint8_t propagate,
+                                    xcb_window_t destination,
+                                    uint32_t event_mask, const char *event);
+    xcb_void_cookie_t (*map_window)(xcb_connection_t *c, xcb_window_t window);
+    xcb_void_cookie_t (*unmap_window)(xcb_connection_t *c, xcb_window_t window);
+    xcb_void_cookie_t (*change_property)(xcb_connection_t *c, uint8_t mode,
+                                         xcb_window_t window,
+                                         xcb_atom_t property, xcb_atom_t type,
+                                         uint8_t format, uint32_t data_len,
+                                         const void *data);
+    xcb_void_cookie_t (*delete_property)(xcb_connection_t *c,
+                                         xcb_window_t window,
+                                         xcb_atom_t property);
+    xcb_void_cookie_t (*change_window_attributes)(xcb_connection_t *c,
+                                                  xcb_window_t window,
+                                                  uint32_t mask,
+                                                  const xcb_params_cw_t *params);
+    xcb_void_cookie_t (*grab_server)(xcb_connection_t *c);
+    xcb_void_cookie_t (*ungrab_server)(xcb_connection_t *c);
+
+    /* Queries */
+    xcb_get_window_attributes_cookie_t
+    (*get_window_attributes)(xcb_connection_t *c, xcb_window_t window);
+    xcb_get_window_attributes_reply_t *
+    (*get_window_attributes_reply)(xcb_connection_t *c,
+                                   xcb_get_window_attributes_cookie_t cookie,
+                                   xcb_generic_error_t **e);
+    xcb_get_geometry_cookie_t (*get_geometry)(xcb_connection_t *c,
+                                              xcb_drawable_t drawable);
+    xcb_get_property_cookie_t (*get_property)(xcb_connection_t *c,
+                                              uint8_t _delete,
+                                              xcb_window_t window,
+                                              xcb_atom_t property,
+                                              xcb_atom_t type,
+                                              uint32_t long_offset,
+                                              uint32_t long_length);
+    xcb_get_property_reply_t *
+    (*get_property_reply)(xcb_connection_t *c, xcb_get_property_cookie_t cookie,
+                          xcb_generic_error_t **e);
+    xcb_query_tree_cookie_t (*query_tree)(xcb_connection_t *c,
+                                          xcb_window_t window);
+    xcb_query_tree_reply_t *
+    (*query_tree_reply)(xcb_connection_t *c, xcb_query_tree_cookie_t cookie,
+                        xcb_generic_error_t **e);
+    xcb_intern_atom_cookie_t (*intern_atom)(xcb_connection_t *c,
+                                            uint8_t only_if_exists,
+                                            uint16_t name_len,
+                                            const char *name);
+    xcb_intern_atom_reply_t *
+    (*intern_atom_reply)(xcb_connection_t *c, xcb_intern_atom_cookie_t cookie,
+                         xcb_generic_error_t **e);
+
+    /* Returns 1 and reply or error if it has arrived, 0 otherwise */
+    int (*poll_for_reply)(xcb_connection_t *c, unsigned int request,
+                          void **reply, xcb_generic_error_t **error);
+} backend_t;
+
+static const backend_t xcb_backend = {
+    xcb_aux_configure_window,
+    xcb_set_input_focus,
+    xcb_send_event,
+    xcb_map_window,
+    xcb_unmap_window,
+    xcb_change_property,
+    xcb_delete_property,
+    xcb_aux_change_window_attributes,
+    xcb_grab_server,
+    xcb_ungrab_server,
+    xcb_get_window_attributes,
+    xcb_get_window_attributes_reply,
+    xcb_get_geometry,
+    xcb_get_property,
+    xcb_get_property_reply,
+    xcb_query_tree,
+    xcb_query_tree_reply,
+    xcb_intern_atom,
+    xcb_intern_atom_reply,
+    xcb_poll_for_reply,
+};
+
+static const backend_t *backend = &xcb_backend;
+
 enum {
     WMProtocols,
     WMDelete,
+    WMTakeFocus,
     WMState,
+    UUWMLayoutSettled,
+    UUWMDamage,
+    UUWMRepaintRate,
+    UUWMTimestamp,
     NetSupported,
     NetWMName,
+    NetWMState,
+    NetWMStateHidden,
+    NetWMPid,
     AtomLast,
     NetFirst=NetSupported,
     NetLast=AtomLast
@@ -66,17 +296,281 @@ static xcb_atom_t atom[AtomLast];
 static const char *atom_names[AtomLast] = {
     "WM_PROTOCOLS",
     "WM_DELETE_WINDOW",
+    "WM_TAKE_FOCUS",
     "WM_STATE",
+    "_UUWM_LAYOUT_SETTLED",
+    "_UUWM_DAMAGE",
+    "_UUWM_REPAINT_RATE",
+    "_UUWM_TIMESTAMP",
     "_NET_SUPPORTED",
-    "_NET_WM_NAME"
+    "_NET_WM_NAME",
+    "_NET_WM_STATE",
+    "_NET_WM_STATE_HIDDEN",
+    "_NET_WM_PID"
 };
 
+/* Iconify obscured clients, set by UUWM_ICONIFY environment variable */
+static bool iconify_obscured = false;
+
+/*
+ * Stop processes all of whose clients are obscured, after a grace period in
+ * milliseconds given by UUWM_FREEZE. Processes named in colon-separated
+ * UUWM_NOFREEZE list are never stopped.
+ */
+static bool freeze_obscured = false;
+static unsigned long freeze_grace_ms;
+static const char *nofreeze;
+
+/*
+ * Foreground boost: process owning the top of focus stack is moved to
+ * UUWM_FG_CGROUP and/or given UUWM_FG_NICE niceness, other processes go to
+ * UUWM_BG_CGROUP and/or get UUWM_BG_NICE. Processes get their original
+ * cgroup and niceness back once they have no managed windows.
+ */
+static bool boost = false;
+static const char *fg_cgroup, *bg_cgroup;
+static const char *fg_nice, *bg_nice;
+static proc_t *foreground = NULL;
+
+static proc_t *procs = NULL;
+
+/*
+ * Layout settle notification, enabled by UUWM_SETTLE. Damaged screen areas
+ * (see damage_publish()) are collected. Once nothing has changed for
+ * UUWM_SETTLE milliseconds, they are published in root window's
+ * _UUWM_LAYOUT_SETTLED property as CARDINAL x, y, width, height quadruples,
+ * so eInk refresh might be done once for the whole burst.
+ */
+#define DIRTY_MAX 16
+
+static bool settle = false;
+static unsigned long settle_ms;
+static xcb_rectangle_t dirty[DIRTY_MAX];
+static int ndirty = 0;
+static timeout_t settle_timeout;
+
+/* Set of non-overlapping rectangles */
+typedef struct {
+    xcb_rectangle_t *rects;
+    int n, size;
+} region_t;
+
+/*
+ * Screen area exposed or covered by restacking, mapping, unmapping and
+ * configuring clients while handling a batch of events. It is computed from
+ * focus stack and client geometry, and fed to settle notification and to
+ * root window's _UUWM_DAMAGE property if UUWM_DAMAGE is set.
+ */
+static bool track_damage = false;
+static bool export_damage = false;
+static region_t damage;
+
+/*
+ * Raise and focus of newly managed clients is deferred by UUWM_MAP_DELAY
+ * milliseconds, so splash windows disappearing quickly cause no restacking.
+ */
+static unsigned long map_delay_ms = 0;
+static unsigned long raises_deferred = 0;
+static unsigned long raises_suppressed = 0;
+
+/*
+ * Once MemAvailable drops below UUWM_LOWMEM kilobytes, least recently
+ * focused background client is asked to close each LOWMEM_PERIOD_MS, so the
+ * OOM killer does not get to the foreground one.
+ */
+#define LOWMEM_PERIOD_MS 2000
+
+static unsigned long lowmem_kb = 0;
+static unsigned long lowmem_closed = 0;
+static timeout_t lowmem_timeout;
+
+/*
+ * Focus taken by a client other than top of stack is given back at once,
+ * unless the client keeps doing that: after FOCUS_FIGHT_STREAK steals less
+ * than FOCUS_FIGHT_MS apart it is a fight, and focus is given back after
+ * a delay doubling up to FOCUS_BACKOFF_MAX_MS.
+ */
+#define FOCUS_FIGHT_MS 1000
+#define FOCUS_FIGHT_STREAK 3
+#define FOCUS_BACKOFF_MS 100
+#define FOCUS_BACKOFF_MAX_MS 10000
+
+static timeout_t refocus_timeout;
+static unsigned long focus_steals = 0;
+static unsigned long focus_allowed = 0;
+static unsigned long focus_fights = 0;
+static unsigned long focus_backoffs = 0;
+
+/*
+ * ConfigureRequests identical to the last one undone by layout are answered
+ * from cache, with synthetic ConfigureNotify sent at most once per
+ * SYNTHETIC_MIN_MS to each client.
+ */
+#define CONFIG_GEOMETRY (XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y \
+                         | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT \
+                         | XCB_CONFIG_WINDOW_BORDER_WIDTH)
+#define SYNTHETIC_MIN_MS 100
+
+static unsigned long configure_cached = 0;
+static unsigned long synthetic_sent = 0;
+static unsigned long synthetic_delayed = 0;
+static unsigned long synthetic_dropped = 0;
+
+/* Geometry commits, and ones which had anything to send */
+static unsigned long geom_commits = 0;
+static unsigned long geom_configures = 0;
+
+/* Armed timeouts, earliest first */
+static timeout_t *timeouts = NULL;
+
 static int sx, sy, sw, sh; /* X display screen geometry x, y, w, h */
 static int wx, wy, ww, wh; /* window area geometry x, y, w, h, docks excluded */
 
 static client_t *clients = NULL;
 static client_t *stack = NULL;
 
+/* Clients whose WM_TRANSIENT_FOR names window not managed, see
+ * adopt_transients() */
+static int norphans = 0;
+
+/*
+ * Clients indexed by window. Open addressing with linear probing, table size
+ * is a power of two kept at most half full.
+ */
+static client_t **index_slots = NULL;
+static int index_bits = 0;
+static unsigned int index_count = 0;
+
+/*
+ * Requests are sent unchecked, so errors caused by them arrive through the
+ * event queue instead of blocking round trips. The latest requests are
+ * remembered in a ring to find out what has failed and how to react.
+ */
+typedef enum {
+    ErrFatal,
+    ErrWarn,
+    ErrIgnore
+} err_policy_t;
+
+typedef struct {
+    unsigned int sequence;
+    const char *what;
+    xcb_window_t win;
+    err_policy_t policy;
+} request_t;
+
+/*
+ * Windows about to be managed. All queries about a window are sent at once,
+ * and run() finishes managing it when the replies arrive, so a slow or
+ * vanishing window does not stall the event loop.
+ */
+enum {
+    PendingAttributes,
+    PendingTransientFor,
+    PendingGeometry,
+    PendingPid,
+    PendingMachine,
+    PendingProtocols,
+    PendingHints,
+    PendingLast
+};
+
+typedef struct pending_t {
+    xcb_window_t win;
+    bool cancelled; /* Window has gone away while waiting for replies */
+
+    unsigned int cookies[PendingLast];
+    void *replies[PendingLast];
+    int nreplies;
+
+    /* Geometry passed through while waiting, newer than GetGeometry reply */
+    uint16_t configured;
+    geom_t geom;
+
+    struct pending_t *next;
+} pending_t;
+
+static pending_t *pending = NULL;
+static pending_t **pending_tail = &pending;
+
+/*
+ * Events already read from connection are handled in batches. Redundant
+ * events in a batch are coalesced before handling.
+ */
+#define BATCH 64
+
+static xcb_generic_event_t *batch[BATCH];
+static int nbatch = 0;
+
+/*
+ * Instrumentation, enabled by UUWM_STATS environment variable. Handler wall
+ * time and number of blocking round trips are recorded per event type and
+ * dumped to stderr on SIGUSR1.
+ */
+#define HIST_BUCKETS 32
+
+typedef struct {
+    unsigned long count;
+    unsigned long max;
+    unsigned long buckets[HIST_BUCKETS]; /* i-th holds values of i bits */
+} hist_t;
+
+typedef struct {
+    unsigned long received; /* Including ones coalesced away */
+    hist_t time; /* microseconds */
+    hist_t roundtrips;
+} event_stats_t;
+
+/* Not events: finishing manage of window, foreground boost */
+#define STATS_MANAGE 128
+#define STATS_BOOST 129
+#define STATS_LAST 130
+
+static event_stats_t *stats = NULL;
+static unsigned long roundtrips = 0;
+static bool dump_enabled = false;   /* SIGUSR1 dumps diagnostics */
+
+/*
+ * Events which are not handled, but are selected unless UUWM_MINIMAL_MASK
+ * is set. Batches consisting of them only are wakeups for nothing.
+ */
+static bool minimal_mask = false;
+static unsigned long batches = 0;
+static unsigned long avoidable_batches = 0;
+static unsigned long avoidable_events = 0;
+static int batch_received = 0;
+static int batch_avoidable = 0;
+static bool dump_requested = false;
+
+#ifdef XDAMAGE
+/*
+ * Repaint monitoring, enabled by UUWM_REPAINT. XDamage events are counted
+ * per client and dumped along with statistics on SIGUSR1.
+ */
+static bool repaint_monitor = false;
+static uint8_t damage_event;
+#endif
+
+#ifdef XRES
+/*
+ * Server-side memory accounting, enabled by UUWM_XRES. Clients are sampled
+ * every xres_period_ms (if not 0) and on SIGUSR1, which also dumps the
+ * samples.
+ */
+static bool xres_monitor = false;
+static unsigned long xres_period_ms = 0;
+static timeout_t xres_timeout;
+#endif
+
+/* Window and its transients being raised, bottom first */
+static client_t **raise_group = NULL;
+static int raise_group_size = 0;
+
+#define REQUESTS 64
+
+static request_t requests[REQUESTS];
+static unsigned int requests_pos = 0;
+
 #ifdef OLD_XCB_AUX
 /* Omission from xcb-aux */
 static void
@@ -97,37 +591,1138 @@ xcb_aux_change_window_attributes_checked (xcb_connection_t      *c,
     pack_list(mask, (const uint32_t *)params, value_list);
     return xcb_change_window_attributes_checked( c, window, mask, value_list );
 }
-/* End of omission */
-#endif
+/* End of omission */
+#endif
+
+/* Allocs size zero-filled bytes or dies if unable to do so. */
+static void *
+xalloc(size_t size)
+{
+    void *res = calloc(1, size);
+    if (!res)
+        err(1, "Unable to alloc %d bytes", size);
+    return res;
+}
+
+/* Reallocs memory or dies if unable to do so. */
+static void *
+xrealloc(void *ptr, size_t size)
+{
+    void *res = realloc(ptr, size);
+    if (!res)
+        err(1, "Unable to realloc %lu bytes", (unsigned long)size);
+    return res;
+}
+
+static void
+debug(const char *errstr, ...)
+{
+    static bool _debug_init = false;
+    static bool _debug = false;
+
+    if (!_debug_init) {
+        _debug_init = true;
+        _debug = getenv("DEBUG") != NULL;
+    }
+
+    if (!_debug) return;
+
+    fprintf(stderr, "D: ");
+    va_list ap;
+    va_start(ap, errstr);
+    vfprintf(stderr, errstr, ap);
+    va_end(ap);
+}
+
+static void
+track(xcb_void_cookie_t cookie, const char *what, xcb_window_t win,
+      err_policy_t policy)
+{
+    request_t *r = &requests[requests_pos++ % REQUESTS];
+    r->sequence = cookie.sequence;
+    r->what = what;
+    r->win = win;
+    r->policy = policy;
+}
+
+static void
+handle_error(xcb_generic_error_t *err)
+{
+    request_t *r = NULL;
+    int i;
+    for (i = 0; i < REQUESTS; ++i)
+        if (requests[i].what && requests[i].sequence == err->full_sequence)
+            r = &requests[i];
+
+    debug("handle_error: %s %x: error %d (request %d.%d)\n",
+          r ? r->what : "unknown request", r ? r->win : 0,
+          err->error_code, err->major_code, err->minor_code);
+
+    /* BadWindow is ignored as windows may disappear at any time */
+    if (err->error_code == XCB_WINDOW)
+        return;
+
+    /* Request might have been pushed out of the ring by later ones, so
+     * its policy is not known */
+    if (!r) {
+        warnx("X error %d (request %d.%d).", err->error_code,
+              err->major_code, err->minor_code);
+        return;
+    }
+
+    if (r->policy == ErrFatal)
+        errx(1, "Unable to %s %x (%d)", r->what, r->win, err->error_code);
+    if (r->policy == ErrWarn)
+        warnx("Unable to %s %x (%d).", r->what, r->win, err->error_code);
+}
+
+static void
+hist_add(hist_t *h, unsigned long v)
+{
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && v >> b)
+        b++;
+
+    h->count++;
+    h->buckets[b]++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Returns upper bound of bucket holding given percentile */
+static unsigned long
+hist_percentile(const hist_t *h, int percent)
+{
+    unsigned long seen = 0;
+    unsigned long need = (h->count * percent + 99) / 100;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen >= need && seen)
+            return MIN(b ? (1ul << b) - 1 : 0, h->max);
+    }
+    return h->max;
+}
+
+static unsigned long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+}
+
+static const char *
+event_name(int type)
+{
+    static const char *names[] = {
+        "Error", "Reply", "KeyPress", "KeyRelease", "ButtonPress",
+        "ButtonRelease", "MotionNotify", "EnterNotify", "LeaveNotify",
+        "FocusIn", "FocusOut", "KeymapNotify", "Expose", "GraphicsExpose",
+        "NoExposure", "VisibilityNotify", "CreateNotify", "DestroyNotify",
+        "UnmapNotify", "MapNotify", "MapRequest", "ReparentNotify",
+        "ConfigureNotify", "ConfigureRequest", "GravityNotify",
+        "ResizeRequest", "CirculateNotify", "CirculateRequest",
+        "PropertyNotify", "SelectionClear", "SelectionRequest",
+        "SelectionNotify", "ColormapNotify", "ClientMessage", "MappingNotify"
+    };
+
+    if (type == STATS_MANAGE)
+        return "(manage)";
+    if (type == STATS_BOOST)
+        return "(boost)";
+    if (type < sizeof(names)/sizeof(names[0]))
+        return names[type];
+    return "(extension)";
+}
+
+static void
+stats_init()
+{
+    if (!getenv("UUWM_STATS"))
+        return;
+
+    stats = xalloc(sizeof(event_stats_t) * STATS_LAST);
+    dump_enabled = true;
+}
+
+static void
+stats_add(int type, unsigned long start_us, unsigned long start_roundtrips)
+{
+    hist_add(&stats[type].time, now_us() - start_us);
+    hist_add(&stats[type].roundtrips, roundtrips - start_roundtrips);
+}
+
+static void
+stats_dump()
+{
+    int i;
+
+    fprintf(stderr, "uuwm: %-18s %8s %8s %23s %17s\n", "event", "received",
+            "handled", "time p50/p99/max, us", "round trips");
+    for (i = 0; i < STATS_LAST; ++i) {
+        const event_stats_t *s = &stats[i];
+        if (!s->received && !s->time.count)
+            continue;
+        fprintf(stderr, "uuwm: %-18s %8lu %8lu %7lu/%7lu/%7lu %5lu/%5lu/%5lu\n",
+                event_name(i), s->received, s->time.count,
+                hist_percentile(&s->time, 50), hist_percentile(&s->time, 99),
+                s->time.max,
+                hist_percentile(&s->roundtrips, 50),
+                hist_percentile(&s->roundtrips, 99), s->roundtrips.max);
+    }
+
+    fprintf(stderr, "uuwm: event batches: %lu, %lu of them only with %lu "
+            "events UUWM_MINIMAL_MASK avoids\n",
+            batches, avoidable_batches, avoidable_events);
+    if (map_delay_ms)
+        fprintf(stderr, "uuwm: raises deferred: %lu, suppressed: %lu\n",
+                raises_deferred, raises_suppressed);
+    if (lowmem_kb)
+        fprintf(stderr, "uuwm: clients asked to close on low memory: %lu\n",
+                lowmem_closed);
+
+    fprintf(stderr, "uuwm: focus steals: %lu, allowed: %lu, fights: %lu, "
+            "delayed refocus: %lu\n",
+            focus_steals, focus_allowed, focus_fights, focus_backoffs);
+    client_t *c;
+    for (c = clients; c; c = c->next)
+        if (c->steals)
+            fprintf(stderr, "uuwm: window 0x%08x stole focus %lu times\n",
+                    c->win, c->steals);
+
+    fprintf(stderr, "uuwm: configure requests answered from cache: %lu, "
+            "synthetic configure events sent: %lu, delayed: %lu, "
+            "dropped: %lu\n", configure_cached, synthetic_sent,
+            synthetic_delayed, synthetic_dropped);
+    fprintf(stderr, "uuwm: geometry commits: %lu, configure requests sent: "
+            "%lu\n", geom_commits, geom_configures);
+    for (c = clients; c; c = c->next)
+        if (c->configure_cached)
+            fprintf(stderr, "uuwm: window 0x%08x (pid %d) repeated %lu of %lu "
+                    "configure requests\n", c->win,
+                    c->proc ? (int)c->proc->pid : 0, c->configure_cached,
+                    c->configure_requests);
+}
+
+static void
+canceltimeout(timeout_t *t)
+{
+    timeout_t **tt = &timeouts;
+
+    if (!t->armed)
+        return;
+
+    while (*tt != t)
+        tt = &(*tt)->next;
+    *tt = t->next;
+    t->armed = false;
+}
+
+/* Arms timeout to call fn(arg) after ms milliseconds */
+static void
+settimeout(timeout_t *t, unsigned long ms, void (*fn)(void *), void *arg)
+{
+    canceltimeout(t);
+
+    t->when = now_us() + ms * 1000;
+    t->fn = fn;
+    t->arg = arg;
+    t->armed = true;
+
+    timeout_t **tt = &timeouts;
+    while (*tt && (*tt)->when <= t->when)
+        tt = &(*tt)->next;
+    t->next = *tt;
+    *tt = t;
+}
+
+static void
+run_timeouts()
+{
+    unsigned long now = now_us();
+
+    while (timeouts && timeouts->when <= now) {
+        timeout_t *t = timeouts;
+        timeouts = t->next;
+        t->armed = false;
+        t->fn(t->arg);
+    }
+}
+
+/* Arms timerfd to the earliest armed timeout, disarms it if there is none */
+static void
+arm_timer(int tfd)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+
+    if (timeouts) {
+        its.it_value.tv_sec = timeouts->when / 1000000;
+        /* Zero it_value would disarm timer */
+        its.it_value.tv_nsec = timeouts->when % 1000000 * 1000 + 1;
+    }
+
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        err(1, "unable to arm timer");
+}
+
+/* Checks whether process name is in UUWM_NOFREEZE list */
+static bool
+is_nofreeze(pid_t pid)
+{
+    char path[32], name[64];
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return true; /* Not a local process, or gone already */
+    if (!fgets(name, sizeof(name), f))
+        name[0] = 0;
+    fclose(f);
+    name[strcspn(name, "\n")] = 0;
+
+    size_t len = strlen(name);
+    const char *p = nofreeze;
+    while (p && *p) {
+        size_t n = strcspn(p, ":");
+        if (n == len && !strncmp(p, name, n))
+            return true;
+        p += n;
+        if (*p)
+            p++;
+    }
+    return false;
+}
+
+static void
+thaw(proc_t *p)
+{
+    if (!p->is_frozen)
+        return;
+
+    debug("thaw: %d\n", p->pid);
+    kill(p->pid, SIGCONT);
+    p->is_frozen = false;
+}
+
+static void
+freeze(void *arg)
+{
+    proc_t *p = arg;
+    if (p->is_frozen || p->nvisible)
+        return;
+
+    debug("freeze: %d\n", p->pid);
+    if (!kill(p->pid, SIGSTOP))
+        p->is_frozen = true;
+}
+
+static void
+thaw_all()
+{
+    proc_t *p;
+    for (p = procs; p; p = p->next)
+        thaw(p);
+}
+
+static void
+set_cgroup(pid_t pid, const char *cgroup)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup);
+
+    /* Write errors show up when buffer is flushed by fclose() */
+    FILE *f = fopen(path, "w");
+    if (f)
+        fprintf(f, "%d\n", (int)pid);
+    if (!f || fclose(f))
+        warn("Unable to move process %d to %s", (int)pid, cgroup);
+}
+
+/* Niceness on Linux is per-thread, so every thread of process is reniced */
+static void
+set_nice(pid_t pid, int nice)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+
+    DIR *d = opendir(path);
+    if (!d) {
+        if (setpriority(PRIO_PROCESS, pid, nice))
+            warn("Unable to set niceness of process %d", (int)pid);
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(d)))
+        if (de->d_name[0] != '.'
+            && setpriority(PRIO_PROCESS, atoi(de->d_name), nice)
+            && errno != ESRCH)
+            warn("Unable to set niceness of thread %s", de->d_name);
+    closedir(d);
+}
+
+/* Returns directory of process' cgroup v2 cgroup, or NULL */
+static char *
+get_cgroup(pid_t pid)
+{
+    char path[PATH_MAX], line[PATH_MAX], mount[PATH_MAX], type[32];
+    char *cgroup = NULL;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", (int)pid);
+    if (!(f = fopen(path, "r")))
+        return NULL;
+    path[0] = 0;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, "0::", 3)) {
+            line[strcspn(line, "\n")] = 0;
+            strcpy(path, line + 3);
+            break;
+        }
+    fclose(f);
+
+    if (!path[0] || !(f = fopen("/proc/self/mounts", "r")))
+        return NULL;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "%*s %4095s %31s", mount, type) == 2
+            && !strcmp(type, "cgroup2")) {
+            cgroup = xalloc(strlen(mount) + strlen(path) + 1);
+            sprintf(cgroup, "%s%s", mount, path);
+            break;
+        }
+    fclose(f);
+    return cgroup;
+}
+
+static void
+set_boost(proc_t *p, bool is_foreground)
+{
+    const char *cgroup = is_foreground ? fg_cgroup : bg_cgroup;
+    const char *nice = is_foreground ? fg_nice : bg_nice;
+
+    /* Never move init or uuwm itself */
+    if (p->pid <= 1 || p->pid == getpid())
+        return;
+
+    debug("set_boost: %d: %d\n", p->pid, is_foreground);
+
+    if (!p->is_boosted) {
+        p->is_boosted = true;
+        errno = 0;
+        p->orig_nice = getpriority(PRIO_PROCESS, p->pid);
+        if (errno)
+            p->orig_nice = 0;
+        if (fg_cgroup || bg_cgroup)
+            p->orig_cgroup = get_cgroup(p->pid);
+    }
+
+    if (cgroup)
+        set_cgroup(p->pid, cgroup);
+    if (nice)
+        set_nice(p->pid, atoi(nice));
+}
+
+/* Gives process back cgroup and niceness it had before set_boost() */
+static void
+unset_boost(proc_t *p)
+{
+    if (!p->is_boosted)
+        return;
+
+    debug("unset_boost: %d\n", p->pid);
+
+    /* Process might have exited together with its windows */
+    if (!kill(p->pid, 0)) {
+        if (p->orig_cgroup)
+            set_cgroup(p->pid, p->orig_cgroup);
+        if (fg_nice || bg_nice)
+            set_nice(p->pid, p->orig_nice);
+    }
+    free(p->orig_cgroup);
+    p->orig_cgroup = NULL;
+    p->is_boosted = false;
+}
+
+/* Boosts process owning the top of focus stack */
+static void
+update_foreground()
+{
+    proc_t *p = stack ? stack->proc : NULL;
+    if (!boost || p == foreground)
+        return;
+
+    unsigned long start_us = stats ? now_us() : 0;
+
+    if (foreground)
+        set_boost(foreground, false);
+    if (p)
+        set_boost(p, true);
+    foreground = p;
+
+    if (stats)
+        stats_add(STATS_BOOST, start_us, roundtrips);
+}
+
+static proc_t *
+getproc(pid_t pid)
+{
+    proc_t *p;
+    for (p = procs; p; p = p->next)
+        if (p->pid == pid)
+            return p;
+
+    p = xalloc(sizeof(proc_t));
+    p->pid = pid;
+    p->never_freeze = pid <= 1 || pid == getpid()
+        || (freeze_obscured && is_nofreeze(pid));
+    p->next = procs;
+    procs = p;
+
+    /* Processes start in background, update_foreground() boosts them */
+    if (boost)
+        set_boost(p, false);
+    return p;
+}
+
+/* Stops or resumes process according to visibility of its clients */
+static void
+proc_update(proc_t *p)
+{
+    if (!freeze_obscured || p->never_freeze)
+        return;
+
+    if (p->nvisible) {
+        canceltimeout(&p->freeze_timeout);
+        thaw(p);
+    } else if (!p->is_frozen && !p->freeze_timeout.armed)
+        settimeout(&p->freeze_timeout, freeze_grace_ms, freeze, p);
+}
+
+static void
+proc_attach(client_t *c, pid_t pid)
+{
+    c->proc = getproc(pid);
+    c->proc->nclients++;
+    if (!c->is_obscured)
+        c->proc->nvisible++;
+    proc_update(c->proc);
+}
+
+static void
+proc_detach(client_t *c)
+{
+    proc_t *p = c->proc;
+    if (!p)
+        return;
+
+    c->proc = NULL;
+    if (!c->is_obscured)
+        p->nvisible--;
+    if (--p->nclients) {
+        proc_update(p);
+        return;
+    }
+
+    /* Process might live on without windows */
+    canceltimeout(&p->freeze_timeout);
+    thaw(p);
+    unset_boost(p);
+    if (foreground == p)
+        foreground = NULL;
+
+    proc_t **pp = &procs;
+    while (*pp != p)
+        pp = &(*pp)->next;
+    *pp = p->next;
+    free(p);
+}
+
+/* Accounts client's visibility change in its process */
+static void
+proc_visibility_changed(client_t *c)
+{
+    proc_t *p = c->proc;
+    if (!p)
+        return;
+
+    p->nvisible += c->is_obscured ? -1 : 1;
+    proc_update(p);
+}
+
+static void
+publish_settled(void *arg)
+{
+    uint32_t data[DIRTY_MAX * 4];
+    int i;
+
+    for (i = 0; i < ndirty; ++i) {
+        data[i * 4] = dirty[i].x;
+        data[i * 4 + 1] = dirty[i].y;
+        data[i * 4 + 2] = dirty[i].width;
+        data[i * 4 + 3] = dirty[i].height;
+    }
+
+    debug("publish_settled: %d rectangles\n", ndirty);
+    track(backend->change_property(conn, XCB_PROP_MODE_REPLACE, screen->root,
+                                   atom[UUWMLayoutSettled], CARDINAL, 32,
+                                   ndirty * 4, data),
+          "publish settled layout on", screen->root, ErrWarn);
+    ndirty = 0;
+}
+
+/* Marks screen area as changed and restarts settle timeout */
+static void
+add_dirty(xcb_rectangle_t r)
+{
+    int i;
+
+    for (i = 0; i < ndirty; ++i)
+        if (dirty[i].x <= r.x && dirty[i].y <= r.y
+            && dirty[i].x + dirty[i].width >= r.x + r.width
+            && dirty[i].y + dirty[i].height >= r.y + r.height)
+            break;
+
+    if (i == ndirty) {
+        if (ndirty == DIRTY_MAX) {
+            /* Too fragmented, fall back to bounding box */
+            for (i = 0; i < ndirty; ++i) {
+                int x2 = MAX(r.x + r.width, dirty[i].x + dirty[i].width);
+                int y2 = MAX(r.y + r.height, dirty[i].y + dirty[i].height);
+                r.x = MIN(r.x, dirty[i].x);
+                r.y = MIN(r.y, dirty[i].y);
+                r.width = x2 - r.x;
+                r.height = y2 - r.y;
+            }
+            ndirty = 0;
+        }
+        dirty[ndirty++] = r;
+    }
+
+    settimeout(&settle_timeout, settle_ms, publish_settled, NULL);
+}
+
+static void
+region_append(region_t *r, xcb_rectangle_t rect)
+{
+    if (r->n == r->size) {
+        r->size = r->size ? r->size * 2 : 16;
+        r->rects = xrealloc(r->rects, sizeof(xcb_rectangle_t) * r->size);
+    }
+    r->rects[r->n++] = rect;
+}
+
+static bool
+rect_intersect(xcb_rectangle_t a, xcb_rectangle_t b, xcb_rectangle_t *out)
+{
+    int x1 = MAX(a.x, b.x);
+    int y1 = MAX(a.y, b.y);
+    int x2 = MIN(a.x + a.width, b.x + b.width);
+    int y2 = MIN(a.y + a.height, b.y + b.height);
+
+    if (x1 >= x2 || y1 >= y2)
+        return false;
+
+    out->x = x1;
+    out->y = y1;
+    out->width = x2 - x1;
+    out->height = y2 - y1;
+    return true;
+}
+
+/* Puts parts of a outside of b to out, returns their number (up to 4) */
+static int
+rect_subtract(xcb_rectangle_t a, xcb_rectangle_t b, xcb_rectangle_t *out)
+{
+    xcb_rectangle_t i;
+    int n = 0;
+
+    if (!rect_intersect(a, b, &i)) {
+        out[0] = a;
+        return 1;
+    }
+
+    /* Full-width bands above and below, side parts in between */
+    if (i.y > a.y) {
+        xcb_rectangle_t top = { a.x, a.y, a.width, i.y - a.y };
+        out[n++] = top;
+    }
+    if (i.y + i.height < a.y + a.height) {
+        xcb_rectangle_t bottom = { a.x, i.y + i.height, a.width,
+                                   a.y + a.height - i.y - i.height };
+        out[n++] = bottom;
+    }
+    if (i.x > a.x) {
+        xcb_rectangle_t left = { a.x, i.y, i.x - a.x, i.height };
+        out[n++] = left;
+    }
+    if (i.x + i.width < a.x + a.width) {
+        xcb_rectangle_t right = { i.x + i.width, i.y,
+                                  a.x + a.width - i.x - i.width, i.height };
+        out[n++] = right;
+    }
+    return n;
+}
+
+static void
+region_subtract(region_t *r, xcb_rectangle_t rect)
+{
+    static region_t result;
+    int i, j;
+
+    result.n = 0;
+    for (i = 0; i < r->n; ++i) {
+        xcb_rectangle_t pieces[4];
+        int n = rect_subtract(r->rects[i], rect, pieces);
+        for (j = 0; j < n; ++j)
+            region_append(&result, pieces[j]);
+    }
+
+    /* Swap buffers */
+    region_t t = *r;
+    *r = result;
+    result = t;
+}
+
+/* Adds parts of rectangle not in region yet */
+static void
+region_add(region_t *r, xcb_rectangle_t rect)
+{
+    static region_t pieces;
+    int i;
+
+    pieces.n = 0;
+    region_append(&pieces, rect);
+    for (i = 0; i < r->n && pieces.n; ++i)
+        region_subtract(&pieces, r->rects[i]);
+
+    for (i = 0; i < pieces.n; ++i)
+        region_append(r, pieces.rects[i]);
+}
+
+static xcb_rectangle_t
+client_rect(client_t *c)
+{
+    xcb_rectangle_t r = { c->x, c->y, c->w + 2 * c->bw, c->h + 2 * c->bw };
+    return r;
+}
+
+static void
+damage_add(xcb_rectangle_t r)
+{
+    xcb_rectangle_t screen_rect = { sx, sy, sw, sh };
+    if (rect_intersect(r, screen_rect, &r))
+        region_add(&damage, r);
+}
+
+/*
+ * Adds part of rectangle not covered by clients above c in focus stack.
+ * Client with deferred raise is accounted only when raised, so one which
+ * goes away before that causes no update.
+ */
+static void
+damage_visible(client_t *c, xcb_rectangle_t r)
+{
+    static region_t visible;
+
+    if (!track_damage || c->raise_timeout.armed)
+        return;
+
+    visible.n = 0;
+    region_append(&visible, r);
+
+    client_t *a;
+    for (a = c->sprev; a && visible.n; a = a->sprev)
+        if (!a->is_iconic)
+            region_subtract(&visible, client_rect(a));
+
+    int i;
+    for (i = 0; i < visible.n; ++i)
+        damage_add(visible.rects[i]);
+}
+
+/*
+ * Publishes damage collected while handling events. Called once per batch,
+ * so a single change spanning several events gives one update.
+ */
+static void
+damage_publish()
+{
+    int i;
+
+    if (!damage.n)
+        return;
+
+    debug("damage_publish: %d rectangles\n", damage.n);
+
+    if (export_damage) {
+        uint32_t *data = xalloc(sizeof(uint32_t) * 4 * damage.n);
+        for (i = 0; i < damage.n; ++i) {
+            data[i * 4] = damage.rects[i].x;
+            data[i * 4 + 1] = damage.rects[i].y;
+            data[i * 4 + 2] = damage.rects[i].width;
+            data[i * 4 + 3] = damage.rects[i].height;
+        }
+        track(backend->change_property(conn, XCB_PROP_MODE_REPLACE,
+                                       screen->root, atom[UUWMDamage],
+                                       CARDINAL, 32, damage.n * 4, data),
+              "publish damage on", screen->root, ErrWarn);
+        free(data);
+    }
+
+    if (settle)
+        for (i = 0; i < damage.n; ++i)
+            add_dirty(damage.rects[i]);
+
+    damage.n = 0;
+}
+
+#ifdef XDAMAGE
+static void
+repaint_init()
+{
+    if (!getenv("UUWM_REPAINT"))
+        return;
+
+    const xcb_query_extension_reply_t *ext
+        = xcb_get_extension_data(conn, &xcb_damage_id);
+    roundtrips++;
+    if (!ext || !ext->present) {
+        warnx("DAMAGE extension is not available, repaints are not monitored.");
+        return;
+    }
+
+    /* Extension refuses to work until version is negotiated */
+    roundtrips++;
+    free(xcb_damage_query_version_reply(conn,
+                                        xcb_damage_query_version(conn, 1, 1),
+                                        NULL));
+
+    damage_event = ext->first_event + XCB_DAMAGE_NOTIFY;
+    repaint_monitor = true;
+    dump_enabled = true;
+}
+
+/* Drops buckets older than REPAINT_SECONDS */
+static void
+repaint_advance(repaint_t *r, unsigned long sec)
+{
+    if (sec - r->sec >= REPAINT_SECONDS) {
+        memset(r->events, 0, sizeof(r->events));
+        memset(r->area, 0, sizeof(r->area));
+    } else
+        while (r->sec < sec) {
+            r->sec++;
+            r->events[r->sec % REPAINT_SECONDS] = 0;
+            r->area[r->sec % REPAINT_SECONDS] = 0;
+        }
+    r->sec = sec;
+}
+
+static void
+repaint_add(repaint_t *r, unsigned long area)
+{
+    unsigned long sec = now_us() / 1000000;
+    repaint_advance(r, sec);
+    r->events[sec % REPAINT_SECONDS]++;
+    r->area[sec % REPAINT_SECONDS] += area;
+}
+
+/*
+ * Dumps repaint rates of clients to stderr and to their _UUWM_REPAINT_RATE
+ * properties (CARDINAL events, pixels per REPAINT_SECONDS). Obscured
+ * clients which still repaint are flagged.
+ */
+static void
+repaint_dump()
+{
+    unsigned long sec = now_us() / 1000000;
+    client_t *c;
+
+    if (!repaint_monitor)
+        return;
+
+    fprintf(stderr, "uuwm: %-10s %8s %12s (last %d s)\n", "window",
+            "repaints", "pixels", REPAINT_SECONDS);
+    for (c = clients; c; c = c->next) {
+        uint32_t sum[2] = { 0, 0 };
+        int i;
+
+        repaint_advance(&c->repaint, sec);
+        for (i = 0; i < REPAINT_SECONDS; ++i) {
+            sum[0] += c->repaint.events[i];
+            sum[1] += c->repaint.area[i];
+        }
+
+        fprintf(stderr, "uuwm: 0x%08x %8u %12u%s\n", c->win, sum[0], sum[1],
+                c->is_obscured && sum[0] ? " obscured!" : "");
+        backend->change_property(conn, XCB_PROP_MODE_REPLACE, c->win,
+                                 atom[UUWMRepaintRate], CARDINAL, 32, 2, sum);
+    }
+}
+
+#endif
+
+#ifdef XRES
+static void
+xres_add(client_t *c, const xres_sample_t *sample)
+{
+    if (c->nxres == XRES_HISTORY) {
+        memmove(c->xres, c->xres + 1, sizeof(c->xres) - sizeof(c->xres[0]));
+        c->nxres--;
+    }
+    c->xres[c->nxres++] = *sample;
+}
+
+/*
+ * Samples resource usage of X clients owning managed windows. Requests for
+ * all windows are sent before waiting for the first reply, so it costs a
+ * single round trip.
+ */
+static void
+xres_sample()
+{
+    xcb_res_query_client_resources_cookie_t *rc;
+    xcb_res_query_client_pixmap_bytes_cookie_t *pc;
+    unsigned long when = now_us() / 1000000;
+    client_t *c;
+    int i, n = 0;
+
+    for (c = clients; c; c = c->next)
+        n++;
+    if (!n)
+        return;
+
+    rc = xalloc(sizeof(*rc) * n);
+    pc = xalloc(sizeof(*pc) * n);
+
+    for (c = clients, i = 0; c; c = c->next, i++) {
+        rc[i] = xcb_res_query_client_resources(conn, c->win);
+        pc[i] = xcb_res_query_client_pixmap_bytes(conn, c->win);
+    }
+
+    roundtrips++;
+    for (c = clients, i = 0; c; c = c->next, i++) {
+        xcb_generic_error_t *re = NULL, *pe = NULL;
+        xcb_res_query_client_resources_reply_t *r
+            = xcb_res_query_client_resources_reply(conn, rc[i], &re);
+        xcb_res_query_client_pixmap_bytes_reply_t *p
+            = xcb_res_query_client_pixmap_bytes_reply(conn, pc[i], &pe);
+
+        /* Client has gone away already */
+        if (r && p) {
+            xres_sample_t sample = { when, p->bytes, 0 };
+            xcb_res_type_iterator_t it
+                = xcb_res_query_client_resources_types_iterator(r);
+            for (; it.rem; xcb_res_type_next(&it))
+                sample.resources += it.data->count;
+            if (p->bytes_overflow)
+                sample.pixmap_bytes += (uint64_t)p->bytes_overflow << 32;
+            xres_add(c, &sample);
+        }
+
+        free(r);
+        free(p);
+        free(re);
+        free(pe);
+    }
+
+    free(rc);
+    free(pc);
+}
+
+static void
+xres_periodic(void *arg)
+{
+    xres_sample();
+    settimeout(&xres_timeout, xres_period_ms, xres_periodic, NULL);
+}
+
+static void
+xres_init()
+{
+    const char *s = getenv("UUWM_XRES");
+    if (!s)
+        return;
+
+    const xcb_query_extension_reply_t *ext
+        = xcb_get_extension_data(conn, &xcb_res_id);
+    roundtrips++;
+    if (!ext || !ext->present) {
+        warnx("X-Resource extension is not available, memory is not accounted.");
+        return;
+    }
+
+    xres_monitor = true;
+    xres_period_ms = strtoul(s, NULL, 10) * 1000;
+    if (xres_period_ms)
+        settimeout(&xres_timeout, xres_period_ms, xres_periodic, NULL);
+    dump_enabled = true;
+}
+
+/*
+ * Dumps server-side memory of clients to stderr: current pixmap bytes and
+ * resources, and change since the oldest sample. Windows of the same X
+ * client report the same figures.
+ */
+static void
+xres_dump()
+{
+    client_t *c;
+
+    if (!xres_monitor)
+        return;
+
+    xres_sample();
+
+    fprintf(stderr, "uuwm: %-10s %7s %12s %10s %9s %6s\n", "window", "pid",
+            "pixmap bytes", "change", "resources", "change");
+    for (c = clients; c; c = c->next) {
+        if (!c->nxres)
+            continue;
+
+        const xres_sample_t *first = &c->xres[0];
+        const xres_sample_t *last = &c->xres[c->nxres - 1];
+        fprintf(stderr, "uuwm: 0x%08x %7d %12llu %+10lld %9u %+6d (%lu s)\n",
+                c->win, c->proc ? (int)c->proc->pid : 0,
+                (unsigned long long)last->pixmap_bytes,
+                (long long)(last->pixmap_bytes - first->pixmap_bytes),
+                last->resources, (int)(last->resources - first->resources),
+                last->when - first->when);
+    }
+}
+#endif
+
+/* Returns MemAvailable in kilobytes, or ULONG_MAX if unknown */
+static unsigned long
+mem_available()
+{
+    unsigned long kb = ULONG_MAX;
+    char line[128];
+    FILE *f;
+
+    if (!(f = fopen("/proc/meminfo", "r")))
+        return kb;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+/*
+ * Zero-length append to time window changes nothing, but makes server
+ * report its current time in PropertyNotify, ICCCM 2.1.
+ */
+static void
+request_time()
+{
+    backend->change_property(conn, XCB_PROP_MODE_APPEND, time_window,
+                             atom[UUWMTimestamp], STRING, 8, 0, NULL);
+}
+
+/*
+ * Sends WM_PROTOCOLS client message, ICCCM 4.2.8. Timestamp is the latest
+ * one seen, as waiting for a fresh one would block the event loop.
+ */
+static void
+send_protocol(client_t *c, xcb_atom_t protocol, const char *what)
+{
+    xcb_client_message_event_t e;
+
+    memset(&e, 0, sizeof(e));
+    e.response_type = XCB_CLIENT_MESSAGE;
+    e.format = 32;
+    e.window = c->win;
+    e.type = atom[WMProtocols];
+    e.data.data32[0] = protocol;
+    e.data.data32[1] = last_time;
+
+    xcb_void_cookie_t cookie
+        = backend->send_event(conn, false, c->win, XCB_EVENT_MASK_NO_EVENT,
+                              (const char *)&e);
+    track(cookie, what, c->win, ErrWarn);
+    request_time();
+}
+
+static void
+close_client(client_t *c)
+{
+    /* Stopped process can't answer, and is not stopped again till it exits */
+    if (c->proc) {
+        canceltimeout(&c->proc->freeze_timeout);
+        thaw(c->proc);
+        c->proc->never_freeze = true;
+    }
+    send_protocol(c, atom[WMDelete], "send WM_DELETE_WINDOW to");
+    c->close_requested = true;
+}
+
+/*
+ * Asks the least recently focused client to close if memory is low. Only
+ * obscured clients which support WM_DELETE_WINDOW and were not asked before
+ * are considered, the focused one never is.
+ */
+static void
+check_lowmem(void *arg)
+{
+    unsigned long kb = mem_available();
+    client_t *c, *victim = NULL;
+
+    settimeout(&lowmem_timeout, LOWMEM_PERIOD_MS, check_lowmem, NULL);
+
+    if (kb >= lowmem_kb)
+        return;
+
+    for (c = stack; c && c->snext; c = c->snext)
+        ;
+    for (; c && c != stack; c = c->sprev)
+        if (c->can_delete && !c->close_requested && c->is_obscured) {
+            victim = c;
+            break;
+        }
+
+    if (victim) {
+        warnx("%lu kB of memory available, asking window 0x%x to close",
+              kb, victim->win);
+        close_client(victim);
+        lowmem_closed++;
+    }
+}
 
-/* Allocs size zero-filled bytes or dies if unable to do so. */
-static void *
-xalloc(size_t size)
+/* Picks protocols uuwm uses from WM_PROTOCOLS reply */
+static void
+set_protocols(client_t *c, xcb_get_property_reply_t *protocols)
 {
-    void *res = calloc(1, size);
-    if (!res)
-        err(1, "Unable to alloc %d bytes", size);
-    return res;
+    c->can_delete = c->take_focus = false;
+
+    if (!protocols || protocols->type != ATOM || protocols->format != 32)
+        return;
+
+    xcb_atom_t *a = xcb_get_property_value(protocols);
+    int i, n = xcb_get_property_value_length(protocols) / sizeof(xcb_atom_t);
+    for (i = 0; i < n; ++i)
+        if (a[i] == atom[WMDelete])
+            c->can_delete = true;
+        else if (a[i] == atom[WMTakeFocus])
+            c->take_focus = true;
 }
 
+/* Picks input field from WM_HINTS reply. Missing one means input is wanted */
 static void
-debug(const char *errstr, ...)
+set_hints(client_t *c, xcb_get_property_reply_t *hints)
 {
-    static bool _debug_init = false;
-    static bool _debug = false;
-
-    if (!_debug_init) {
-        _debug_init = true;
-        _debug = getenv("DEBUG") != NULL;
-    }
+    c->accepts_input = true;
 
-    if (!_debug) return;
+    if (!hints || hints->type != WM_HINTS || hints->format != 32
+        || xcb_get_property_value_length(hints) < 2 * sizeof(uint32_t))
+        return;
 
-    fprintf(stderr, "D: ");
-    va_list ap;
-    va_start(ap, errstr);
-    vfprintf(stderr, errstr, ap);
-    va_end(ap);
+    uint32_t *h = xcb_get_property_value(hints);
+    if (h[0] & XCB_WM_HINT_INPUT)
+        c->accepts_input = h[1];
 }
 
 static void
@@ -163,12 +1758,35 @@ configure_event(client_t *c)
     e.override_redirect = false;
 
     xcb_void_cookie_t cookie
-        = xcb_send_event(conn, false, c->win,
-                         XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char*)&e);
-    xcb_generic_error_t *err = xcb_request_check(conn, cookie);
-    if (err)
-        errx(1, "Unable to send configure event to %x (%d)", c->win,
-             err->error_code);
+        = backend->send_event(conn, false, c->win,
+                              XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char*)&e);
+    track(cookie, "send configure event to", c->win, ErrFatal);
+
+    c->last_synthetic_us = now_us();
+    synthetic_sent++;
+}
+
+static void
+deferred_configure_event(void *arg)
+{
+    configure_event(arg);
+}
+
+/* Sends synthetic ConfigureNotify unless one has just been sent */
+static void
+configure_event_limited(client_t *c)
+{
+    unsigned long since_ms = (now_us() - c->last_synthetic_us) / 1000;
+
+    if (c->synthetic_timeout.armed)
+        synthetic_dropped++;
+    else if (since_ms >= SYNTHETIC_MIN_MS)
+        configure_event(c);
+    else {
+        synthetic_delayed++;
+        settimeout(&c->synthetic_timeout, SYNTHETIC_MIN_MS - since_ms,
+                   deferred_configure_event, c);
+    }
 }
 
 static void
@@ -177,59 +1795,101 @@ configure(xcb_window_t win, uint16_t mask, xcb_params_configure_window_t *params
     debug("configure: win: %x, mask %d\n", win, mask);
 
     xcb_void_cookie_t c
-        = xcb_aux_configure_window(conn, win, mask, params);
+        = backend->configure_window(conn, win, mask, params);
+    track(c, "configure window", win, ErrFatal);
+}
 
-    xcb_generic_error_t *err = xcb_request_check(conn, c);
-    if (err) {
-        debug("configure: xcb_aux_configure_window error: %d\n", err->error_code);
-        if (err->error_code != XCB_WINDOW)
-            errx(1, "Unable to configure window %x (%d)", win, err->error_code);
-        /* BadWindow is ignored as windows may disappear at any time */
-        free(err);
-    }
+static geom_t
+client_geom(client_t *c)
+{
+    geom_t g = { c->x, c->y, c->w, c->h, c->bw };
+    return g;
 }
 
+/* Applies layout to desired geometry */
 static void
-arrange_updated(client_t *c, uint16_t m, xcb_params_configure_window_t *p)
+layout_geom(client_t *c, geom_t *g)
 {
     if (c->is_floating) {
-        if (c->x < wx) { XCB_AUX_ADD_PARAM(&m, p, x, wx); c->x = wx; }
-        if (c->y < wy) { XCB_AUX_ADD_PARAM(&m, p, y, wy); c->y = wy; }
-        if (c->w > ww) { XCB_AUX_ADD_PARAM(&m, p, width, ww); c->w = ww; }
-        if (c->h > wh) { XCB_AUX_ADD_PARAM(&m, p, height, wh); c->h = wh; }
+        g->x = MAX(g->x, wx);
+        g->y = MAX(g->y, wy);
+        g->w = MIN(g->w, ww);
+        g->h = MIN(g->h, wh);
     } else {
-        if (c->x != wx) { XCB_AUX_ADD_PARAM(&m, p, x, wx); c->x = wx; }
-        if (c->y != wy) { XCB_AUX_ADD_PARAM(&m, p, y, wy); c->y = wy; }
-        if (c->w != ww) { XCB_AUX_ADD_PARAM(&m, p, width, ww); c->w = ww; }
-        if (c->h != wx) { XCB_AUX_ADD_PARAM(&m, p, height, wh); c->h = wh; }
+        g->x = wx;
+        g->y = wy;
+        g->w = ww;
+        g->h = wh;
+    }
+    g->bw = 0;
+}
+
+/*
+ * Commits desired geometry of client: only fields differing from committed
+ * geometry are sent. is_request tells whether client's ConfigureRequest is
+ * being answered.
+ */
+static void
+commit_geom(client_t *c, const geom_t *g, bool is_request)
+{
+    uint16_t changed = 0;
+    uint16_t m = 0;
+    xcb_params_configure_window_t p;
+
+    geom_commits++;
+
+    if (g->x != c->x) {
+        changed |= XCB_CONFIG_WINDOW_X;
+        XCB_AUX_ADD_PARAM(&m, &p, x, g->x);
+    }
+    if (g->y != c->y) {
+        changed |= XCB_CONFIG_WINDOW_Y;
+        XCB_AUX_ADD_PARAM(&m, &p, y, g->y);
+    }
+    if (g->w != c->w) {
+        changed |= XCB_CONFIG_WINDOW_WIDTH;
+        XCB_AUX_ADD_PARAM(&m, &p, width, g->w);
+    }
+    if (g->h != c->h) {
+        changed |= XCB_CONFIG_WINDOW_HEIGHT;
+        XCB_AUX_ADD_PARAM(&m, &p, height, g->h);
+    }
+    if (g->bw != c->bw) {
+        changed |= XCB_CONFIG_WINDOW_BORDER_WIDTH;
+        XCB_AUX_ADD_PARAM(&m, &p, border_width, g->bw);
     }
 
-    if (c->bw != 0) { XCB_AUX_ADD_PARAM(&m, p, border_width, 0); c->bw = 0; }
+    if (changed) {
+        /* Both old and new place of window are damaged */
+        damage_visible(c, client_rect(c));
+        c->x = g->x;
+        c->y = g->y;
+        c->w = g->w;
+        c->h = g->h;
+        c->bw = g->bw;
+        damage_visible(c, client_rect(c));
+
+        geom_configures++;
+        configure(c->win, m, &p);
+    }
 
-    /* ICCCM 4.1.5: Do not send synthetic ConfigureNotify if window borders or
-     * size have changed */
-    if (!(m & ((1<<XCB_AUX_INTERNAL_OFFSETOF(p, width))
-               ||(1<<XCB_AUX_INTERNAL_OFFSETOF(p, height))
-               ||(1<<XCB_AUX_INTERNAL_OFFSETOF(p, border_width)))))
+    /* ICCCM 4.1.5: resize or border change is reported by real
+     * ConfigureNotify. Otherwise request is answered by synthetic one, and
+     * so is a move by window manager, ICCCM 4.2.3. */
+    if (!(changed & (XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT
+                     | XCB_CONFIG_WINDOW_BORDER_WIDTH))
+        && (is_request || changed))
         configure_event(c);
-
-    if (m)
-        configure(c->win, m, p);
 }
 
-/*
- * Evaluates client state and adjusts it according to environment.
- *
- * Does not alter stack position of window, only x/y/w/h/border_width.
- */
 static void
 arrange(client_t *c)
 {
     debug("arrange: client %x (is_floating: %d)\n", c, c->is_floating);
 
-    uint16_t m = 0;
-    xcb_params_configure_window_t p;
-    arrange_updated(c, m, &p);
+    geom_t g = client_geom(c);
+    layout_geom(c, &g);
+    commit_geom(c, &g, false);
 }
 
 
@@ -257,12 +1917,14 @@ intern_atoms(int count, xcb_atom_t atoms[], const char *atom_names[])
 
     int i;
     for (i = 0; i < count; ++i)
-        c[i] = xcb_intern_atom(conn, false, strlen(atom_names[i]), atom_names[i]);
+        c[i] = backend->intern_atom(conn, false, strlen(atom_names[i]),
+                                    atom_names[i]);
 
+    roundtrips++;
     for (i = 0; i < count; ++i) {
         xcb_generic_error_t *err;
         xcb_intern_atom_reply_t *r
-            = xcb_intern_atom_reply(conn, c[i], &err);
+            = backend->intern_atom_reply(conn, c[i], &err);
         if (!r)
             errx(1, "Unable to intern atom %s", atom_names[i]);
         atoms[i] = r->atom;
@@ -285,6 +1947,46 @@ setup()
 
     intern_atoms(sizeof(atom)/sizeof(atom[0]), atom, atom_names);
 
+    stats_init();
+#ifdef XDAMAGE
+    repaint_init();
+#endif
+#ifdef XRES
+    xres_init();
+#endif
+
+    iconify_obscured = getenv("UUWM_ICONIFY") != NULL;
+
+    if (getenv("UUWM_FREEZE")) {
+        freeze_obscured = true;
+        freeze_grace_ms = strtoul(getenv("UUWM_FREEZE"), NULL, 10);
+        nofreeze = getenv("UUWM_NOFREEZE");
+        /* Never leave processes stopped, even on fatal errors */
+        atexit(thaw_all);
+    }
+
+    fg_cgroup = getenv("UUWM_FG_CGROUP");
+    bg_cgroup = getenv("UUWM_BG_CGROUP");
+    fg_nice = getenv("UUWM_FG_NICE");
+    bg_nice = getenv("UUWM_BG_NICE");
+    boost = fg_cgroup || bg_cgroup || fg_nice || bg_nice;
+
+    if (getenv("UUWM_SETTLE")) {
+        settle = true;
+        settle_ms = strtoul(getenv("UUWM_SETTLE"), NULL, 10);
+    }
+    if (getenv("UUWM_MAP_DELAY"))
+        map_delay_ms = strtoul(getenv("UUWM_MAP_DELAY"), NULL, 10);
+
+    if (getenv("UUWM_LOWMEM")) {
+        lowmem_kb = strtoul(getenv("UUWM_LOWMEM"), NULL, 10);
+        if (lowmem_kb)
+            settimeout(&lowmem_timeout, LOWMEM_PERIOD_MS, check_lowmem, NULL);
+    }
+
+    export_damage = getenv("UUWM_DAMAGE") != NULL;
+    track_damage = settle || export_damage;
+
     /* FIXME: busy cursor is nice
     wa.cursor = cursor = XCreateFontCursor(dpy, XC_watch);
     XCB_AUX_ADD_PARAM(&masp, &params, cursor, ...)
@@ -300,16 +2002,20 @@ setup()
     if (xcb_request_check(conn, c))
         errx(1, "Unable to register myself as NetWM-compliant WM.");
 
-    /* select for events */
+    /* select for events. Enter/Leave and root properties are not handled
+     * at all, so minimal mask does without them */
+    minimal_mask = getenv("UUWM_MINIMAL_MASK") != NULL;
+
     uint32_t mask = 0;
     xcb_params_cw_t params;
     XCB_AUX_ADD_PARAM(&mask, &params, event_mask,
                       XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT |
                       XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY |
-                      XCB_EVENT_MASK_ENTER_WINDOW |
-                      XCB_EVENT_MASK_LEAVE_WINDOW |
                       XCB_EVENT_MASK_STRUCTURE_NOTIFY |
-                      XCB_EVENT_MASK_PROPERTY_CHANGE);
+                      (minimal_mask ? 0 :
+                       XCB_EVENT_MASK_ENTER_WINDOW |
+                       XCB_EVENT_MASK_LEAVE_WINDOW |
+                       XCB_EVENT_MASK_PROPERTY_CHANGE));
 
     xcb_void_cookie_t c2
         = xcb_aux_change_window_attributes_checked(conn, screen->root,
@@ -319,52 +2025,209 @@ setup()
     if (e)
         errx(1, "Unable to register event listener for root window: %d.",
              e->error_code);
+
+    /* Override-redirect keeps it from being managed by scan() */
+    uint32_t time_values[] = { true, XCB_EVENT_MASK_PROPERTY_CHANGE };
+    time_window = xcb_generate_id(conn);
+    track(xcb_create_window(conn, XCB_COPY_FROM_PARENT, time_window,
+                            screen->root, -1, -1, 1, 1, 0,
+                            XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT,
+                            XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK,
+                            time_values),
+          "create time window", time_window, ErrFatal);
+    request_time();
 }
 
-static xcb_window_t
-get_transient_for(xcb_window_t win)
+static unsigned int
+index_home(xcb_window_t w)
 {
-    xcb_get_property_cookie_t cookie = xcb_get_wm_transient_for(conn, win);
+    /* Fibonacci hashing: window ids of single X client are sequential */
+    return (uint32_t)(w * 2654435769u) >> (32 - index_bits);
+}
 
-    xcb_get_property_reply_t *transient_reply
-        = xcb_get_property_reply(conn, cookie, NULL);
+static void
+index_insert(client_t *c)
+{
+    unsigned int mask = (1u << index_bits) - 1;
+    unsigned int i = index_home(c->win);
 
-    if (!transient_reply)
-        return XCB_NONE;
+    while (index_slots[i])
+        i = (i + 1) & mask;
+    index_slots[i] = c;
+    index_count++;
+}
 
-    xcb_window_t transient_for = XCB_NONE;
-    if (xcb_get_wm_transient_for_from_reply(&transient_for, transient_reply))
-        return transient_for;
+static void
+index_grow()
+{
+    client_t **old = index_slots;
+    unsigned int oldsize = index_bits ? 1u << index_bits : 0;
+
+    index_bits = index_bits ? index_bits + 1 : 6;
+    index_slots = xalloc(sizeof(client_t *) << index_bits);
+    index_count = 0;
+
+    unsigned int i;
+    for (i = 0; i < oldsize; ++i)
+        if (old[i])
+            index_insert(old[i]);
 
-    return XCB_NONE;
+    free(old);
+}
+
+static void
+index_remove(client_t *c)
+{
+    if (!index_bits)
+        return;
+
+    unsigned int mask = (1u << index_bits) - 1;
+    unsigned int i = index_home(c->win);
+
+    while (index_slots[i] && index_slots[i] != c)
+        i = (i + 1) & mask;
+    if (!index_slots[i])
+        return;
+
+    /* Shift following entries back so probe sequences stay unbroken */
+    unsigned int j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!index_slots[j])
+            break;
+        unsigned int k = index_home(index_slots[j]->win);
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            index_slots[i] = index_slots[j];
+            i = j;
+        }
+    }
+    index_slots[i] = NULL;
+    index_count--;
 }
 
 static client_t *
 getclient(xcb_window_t w)
 {
-    client_t *c = clients;
-    while (c && c->win != w)
-        c = c->next;
-    return c;
+    if (!index_count)
+        return NULL;
+
+    unsigned int mask = (1u << index_bits) - 1;
+    unsigned int i = index_home(w);
+
+    while (index_slots[i] && index_slots[i]->win != w)
+        i = (i + 1) & mask;
+    return index_slots[i];
 }
 
 static void
 attach(client_t *c)
 {
+    c->prev = NULL;
     c->next = clients;
+    if (clients)
+        clients->prev = c;
     clients = c;
+
+    if (!index_bits || (index_count + 1) * 2 > 1u << index_bits)
+        index_grow();
+    index_insert(c);
 }
 
 static void
 detach(client_t *c)
 {
-    client_t **tc = &clients;
+    if (c->prev)
+        c->prev->next = c->next;
+    else if (clients == c)
+        clients = c->next;
+    else
+        return; /* Not attached */
+
+    if (c->next)
+        c->next->prev = c->prev;
+    c->prev = c->next = NULL;
+
+    index_remove(c);
+}
+
+static void
+unlink_transient(client_t *c)
+{
+    client_t *p = c->parent;
+    if (!p)
+        return;
+
+    if (c->tprev)
+        c->tprev->tnext = c->tnext;
+    else
+        p->transients = c->tnext;
+    if (c->tnext)
+        c->tnext->tprev = c->tprev;
+    else
+        p->transients_top = c->tprev;
+    c->tprev = c->tnext = NULL;
+}
+
+/* Puts client on top of its parent's transients list */
+static void
+link_transient(client_t *c)
+{
+    client_t *p = c->parent;
+    if (!p)
+        return;
+
+    c->tnext = NULL;
+    c->tprev = p->transients_top;
+    if (p->transients_top)
+        p->transients_top->tnext = c;
+    else
+        p->transients = c;
+    p->transients_top = c;
+}
+
+static void
+settransient(client_t *c, xcb_window_t transient_for)
+{
+    client_t *p = getclient(transient_for);
+    client_t *t;
+
+    /* WM_TRANSIENT_FOR loops are not followed */
+    for (t = p; t; t = t->parent)
+        if (t == c) {
+            debug("settransient: %x -> %x is a loop\n", c->win, transient_for);
+            p = NULL;
+            break;
+        }
 
-    while (*tc && *tc != c)
-        tc = &(*tc)->next;
+    if (c->transient_for != XCB_NONE && !c->parent)
+        norphans--;
+    unlink_transient(c);
+    c->transient_for = transient_for;
+    c->parent = p;
+    link_transient(c);
+    if (c->transient_for != XCB_NONE && !c->parent)
+        norphans++;
+}
 
-    if (*tc)
-        *tc = c->next;
+/* Forgets client in transients graph, its transients become orphans */
+static void
+cleartransients(client_t *c)
+{
+    if (c->transient_for != XCB_NONE && !c->parent)
+        norphans--;
+    unlink_transient(c);
+    c->parent = NULL;
+    c->transient_for = XCB_NONE;
+
+    client_t *t = c->transients;
+    while (t) {
+        client_t *next = t->tnext;
+        t->parent = NULL;
+        t->tprev = t->tnext = NULL;
+        norphans++;
+        t = next;
+    }
+    c->transients = c->transients_top = NULL;
 }
 
 static void
@@ -372,212 +2235,537 @@ attachstack(client_t *c)
 {
     debug("attachstack: %x (%x)\n", c, c->win);
 
-    c->snext = stack;
-    stack = c;
+    unlink_transient(c);
+    link_transient(c);
+
+    c->sprev = NULL;
+    c->snext = stack;
+    if (stack)
+        stack->sprev = c;
+    stack = c;
+}
+
+static void
+detachstack(client_t *c)
+{
+    if (c->sprev)
+        c->sprev->snext = c->snext;
+    else if (stack == c)
+        stack = c->snext;
+    else
+        return; /* Not in stack */
+
+    if (c->snext)
+        c->snext->sprev = c->sprev;
+    c->sprev = c->snext = NULL;
+}
+
+static void
+setclientstate(client_t *c, long state)
+{
+    long data[] = {state, XCB_NONE};
+
+    xcb_void_cookie_t cookie =
+        backend->change_property(
+            conn, XCB_PROP_MODE_REPLACE, c->win, atom[WMState],
+            atom[WMState], 32, 2, (const void*)data);
+    track(cookie, "set client state of", c->win, ErrWarn);
+}
+
+static void
+set_focus(uint8_t revert_to, xcb_window_t focus)
+{
+    debug("set_focus: win: %x\n", focus);
+
+    xcb_void_cookie_t c
+        = backend->set_input_focus(conn, revert_to, focus, XCB_CURRENT_TIME);
+    /* Errors are ignored, as windows may disappear at any time */
+    track(c, "focus", focus, ErrIgnore);
+}
+
+/* Gives focus to client according to its input model, ICCCM 4.1.7 */
+static void
+give_focus(client_t *c)
+{
+    canceltimeout(&refocus_timeout);
+
+    if (c->accepts_input)
+        set_focus(XCB_INPUT_FOCUS_POINTER_ROOT, c->win);
+    else if (!c->take_focus) /* No input */
+        set_focus(XCB_INPUT_FOCUS_POINTER_ROOT, XCB_INPUT_FOCUS_POINTER_ROOT);
+
+    if (c->take_focus)
+        send_protocol(c, atom[WMTakeFocus], "send WM_TAKE_FOCUS to");
+}
+
+static void
+focus(client_t *c)
+{
+    debug("focus: focusing %p (%x)\n", c, c ? c->win : -1);
+
+    if (!c)
+        c = stack;
+    else {
+        detachstack(c);
+        attachstack(c);
+    }
+
+    if (c)
+        give_focus(c);
+    else
+        set_focus(XCB_INPUT_FOCUS_POINTER_ROOT, screen->root);
+}
+
+static void
+iconify(client_t *c)
+{
+    if (c->is_iconic)
+        return;
+
+    debug("iconify: %x\n", c->win);
+    setclientstate(c, XCB_WM_STATE_ICONIC);
+    c->ignore_unmap++;
+    track(backend->unmap_window(conn, c->win), "unmap window", c->win, ErrWarn);
+    c->is_iconic = true;
+}
+
+static void
+deiconify(client_t *c)
+{
+    if (!c->is_iconic)
+        return;
+
+    debug("deiconify: %x\n", c->win);
+    track(backend->map_window(conn, c->win), "map window", c->win, ErrWarn);
+    setclientstate(c, XCB_WM_STATE_NORMAL);
+    c->is_iconic = false;
+}
+
+/*
+ * Tells client whether it is obscured, so it might stop redrawing. No other
+ * _NET_WM_STATE is supported, so property is just replaced.
+ */
+static void
+setnetwmstate(client_t *c)
+{
+    xcb_void_cookie_t cookie
+        = backend->change_property(conn, XCB_PROP_MODE_REPLACE, c->win,
+                                   atom[NetWMState], ATOM, 32,
+                                   c->is_obscured ? 1 : 0,
+                                   &atom[NetWMStateHidden]);
+    track(cookie, "set _NET_WM_STATE of", c->win, ErrWarn);
+}
+
+static void
+visibility_changed(client_t *c)
+{
+    debug("visibility_changed: %x obscured: %d\n", c->win, c->is_obscured);
+
+    /* Resume process before it is asked to redraw */
+    proc_visibility_changed(c);
+    setnetwmstate(c);
+
+    if (iconify_obscured) {
+        if (c->is_obscured)
+            iconify(c);
+        else
+            deiconify(c);
+    }
+}
+
+/*
+ * Marks clients below the topmost non-floating client as obscured:
+ * non-floating clients take the whole window area, and floating ones are
+ * kept inside of it.
+ *
+ * Everything below the first non-floating client is known to be obscured
+ * already, so the walk stops at the first such client which was obscured
+ * before.
+ */
+static void
+update_visibility()
+{
+    bool covered = false;
+    client_t *c;
+
+    for (c = stack; c; c = c->snext) {
+        if (c->is_obscured != covered) {
+            c->is_obscured = covered;
+            visibility_changed(c);
+        } else if (covered)
+            break;
+
+        if (!c->is_floating)
+            covered = true;
+    }
+}
+
+/*
+ * Puts client and its transients subtree to raise_group starting from n, in
+ * final stacking order. Returns the new group length.
+ */
+static int
+collect_raise_group(client_t *c, int n)
+{
+    if (n == raise_group_size) {
+        raise_group_size = raise_group_size ? raise_group_size * 2 : 16;
+        raise_group = xrealloc(raise_group,
+                               sizeof(client_t *) * raise_group_size);
+    }
+    raise_group[n++] = c;
+
+    client_t *t;
+    for (t = c->transients; t; t = t->tnext)
+        n = collect_raise_group(t, n);
+    return n;
+}
+
+/*
+ * Adds parts of raised window which were covered by windows above it, other
+ * than the ones being raised along.
+ */
+static void
+damage_raised(client_t *c, int n)
+{
+    xcb_rectangle_t r = client_rect(c);
+    client_t *a;
+    int i;
+
+    for (a = c->sprev; a; a = a->sprev) {
+        if (a->is_iconic)
+            continue;
+        for (i = 0; i < n && raise_group[i] != a; ++i)
+            ;
+        xcb_rectangle_t covered;
+        if (i == n && rect_intersect(r, client_rect(a), &covered))
+            damage_add(covered);
+    }
+}
+
+/*
+ * Raises window along with its transients, the topmost one gets focus.
+ */
+static void
+raiseclient(client_t *c)
+{
+    debug("raiseclient: %x (%x)\n", c, c ? c->win : -1);
+
+    int n = collect_raise_group(c, 0);
+    int i;
+
+    /* Deferred transients are raised along, not again by their timers.
+     * Not being in stack yet, they are damaged whole. */
+    for (i = 0; i < n; ++i)
+        if (raise_group[i]->raise_timeout.armed) {
+            canceltimeout(&raise_group[i]->raise_timeout);
+            damage_visible(raise_group[i], client_rect(raise_group[i]));
+        }
+
+    /* Restack top-down, so the windows already in place are never covered
+     * by the ones still to be raised */
+    for (i = n - 1; i >= 0; --i) {
+        uint16_t mask = 0;
+        xcb_params_configure_window_t params;
+        if (i != n - 1) {
+            XCB_AUX_ADD_PARAM(&mask, &params, sibling, raise_group[i + 1]->win);
+            XCB_AUX_ADD_PARAM(&mask, &params, stack_mode, XCB_STACK_MODE_BELOW);
+        } else
+            XCB_AUX_ADD_PARAM(&mask, &params, stack_mode, XCB_STACK_MODE_ABOVE);
+        configure(raise_group[i]->win, mask, &params);
+    }
+
+    if (track_damage)
+        for (i = 0; i < n; ++i)
+            damage_raised(raise_group[i], n);
+
+    for (i = 0; i < n; ++i) {
+        detachstack(raise_group[i]);
+        attachstack(raise_group[i]);
+    }
+
+    /* Iconified client is mapped again before it can be focused */
+    update_visibility();
+    give_focus(stack);
+    update_foreground();
+}
+
+static pending_t *
+getpending(xcb_window_t w)
+{
+    pending_t *p = pending;
+    while (p && (p->cancelled || p->win != w))
+        p = p->next;
+    return p;
+}
+
+/*
+ * Sends all the queries needed to manage window. Managing is finished by
+ * manage_finish() once replies are here.
+ */
+static void
+manage(xcb_window_t w)
+{
+    debug("manage: win %x\n", w);
+
+    pending_t *p = xalloc(sizeof(pending_t));
+    p->win = w;
+    p->cookies[PendingAttributes]
+        = backend->get_window_attributes(conn, w).sequence;
+    p->cookies[PendingTransientFor]
+        = backend->get_property(conn, false, w, WM_TRANSIENT_FOR, WINDOW,
+                                0, 1).sequence;
+    p->cookies[PendingGeometry] = backend->get_geometry(conn, w).sequence;
+    p->cookies[PendingPid]
+        = backend->get_property(conn, false, w, atom[NetWMPid], CARDINAL,
+                                0, 1).sequence;
+    p->cookies[PendingMachine]
+        = backend->get_property(conn, false, w, WM_CLIENT_MACHINE, STRING,
+                                0, 64).sequence;
+    p->cookies[PendingProtocols]
+        = backend->get_property(conn, false, w, atom[WMProtocols], ATOM,
+                                0, 32).sequence;
+    p->cookies[PendingHints]
+        = backend->get_property(conn, false, w, WM_HINTS, WM_HINTS,
+                                0, 9).sequence;
+
+    *pending_tail = p;
+    pending_tail = &p->next;
 }
 
 static void
-detachstack(client_t *c)
+deferred_raise(void *arg)
 {
-    client_t **tc = &stack;
+    client_t *c = arg;
+    debug("deferred_raise: %x\n", c->win);
 
-    while (*tc && *tc != c)
-        tc = &(*tc)->snext;
-
-    if (*tc)
-        *tc = c->snext;
+    /* Not in stack yet, so damaged whole */
+    damage_visible(c, client_rect(c));
+    raiseclient(c);
 }
 
+/* Checks whether WM_CLIENT_MACHINE names this host */
 static bool
-setclientstate(client_t *c, long state)
+is_local(xcb_get_property_reply_t *machine)
 {
-    long data[] = {state, XCB_NONE};
-
-    xcb_void_cookie_t cookie =
-        xcb_change_property_checked(
-            conn, XCB_PROP_MODE_REPLACE, c->win, atom[WMState],
-            atom[WMState], 32, 2, (const void*)data);
+    char hostname[256];
 
-    xcb_generic_error_t *err = xcb_request_check(conn, cookie);
-    if (err) {
-        warnx("Unable to set client state (%d).", err->error_code);
-        free(err);
+    if (!machine || machine->format != 8
+        || gethostname(hostname, sizeof(hostname)))
         return false;
-    }
+    hostname[sizeof(hostname) - 1] = 0;
 
-    return true;
+    int len = xcb_get_property_value_length(machine);
+    return len == strlen(hostname)
+        && !memcmp(xcb_get_property_value(machine), hostname, len);
 }
 
+/* Links t to newly managed client p if WM_TRANSIENT_FOR of t names it */
 static bool
-set_focus(uint8_t revert_to, xcb_window_t focus)
+adopt_transient(client_t *p, client_t *t)
 {
-    debug("set_focus: win: %x\n", focus);
+    if (t == p || t->parent || t->transient_for != p->win)
+        return false;
 
-    xcb_void_cookie_t c
-        = xcb_set_input_focus_checked(conn, revert_to, focus, XCB_CURRENT_TIME);
-    xcb_generic_error_t *err = xcb_request_check(conn, c);
-    if (err) {
-        debug("set_focus: error in xcb_set_focus (%d)\n", err->error_code);
-        /* Errors are ignored, as windows may disappear at any time */
-        free(err);
+    settransient(t, p->win);
+    debug("adopt_transient: %x -> %x\n", t->win, p->win);
+    if (!t->parent || t->is_floating)
         return false;
-    }
 
-    debug("set_focus: ok\n");
+    t->is_floating = true;
+    arrange(t);
     return true;
 }
 
+/*
+ * Transients of client might have been managed before it, or it might have
+ * been withdrawn and mapped again. Stacked ones are adopted bottom first to
+ * keep transients list in stack order, then ones not in stack yet.
+ */
 static void
-focus(client_t *c)
-{
-    xcb_window_t win;
-
-    debug("focus: focusing %p (%x)\n", c, c ? c->win : -1);
-
-    if (!c)
-        c = stack;
-    else {
-        detachstack(c);
-        attachstack(c);
-    }
-
-    if (c)
-        win = c->win;
-    else
-        win = screen->root;
-
-    set_focus(XCB_INPUT_FOCUS_POINTER_ROOT, win);
-}
-
-static client_t *
-raise_transients_for(client_t *stack, client_t *c)
+adopt_transients(client_t *c)
 {
-    debug("raise_transients: %x (%x) for: %x (%x)\n", stack, stack ? stack->win : 0, c, c->win);
-    if (!stack)
-        return c;
-
-    debug(" -> recurse\n");
-    client_t *last_raised = raise_transients_for(stack->snext, c);
-    debug(" <- back\n");
+    client_t *t;
+    bool refloated = false;
 
-    if (get_transient_for(stack->win) != c->win) {
-        debug("window %x (%x) is not a transient for %x (%x)\n", stack, stack->win, c, c->win);
-        return last_raised;
-    }
-
-    debug("window %x (%x) is a transient for %x (%x).\n", stack, stack->win, c, c->win);
-
-    debug("raising %x (%x) above %x (%x)\n", stack, stack->win, last_raised, last_raised->win);
-
-    uint16_t mask = 0;
-    xcb_params_configure_window_t params;
-    XCB_AUX_ADD_PARAM(&mask, &params, sibling, last_raised->win);
-    XCB_AUX_ADD_PARAM(&mask, &params, stack_mode, XCB_STACK_MODE_ABOVE);
-    configure(stack->win, mask, &params);
-    focus(stack);
+    if (!norphans)
+        return;
 
-    debug("marking %x (%x) as last raised\n", stack, stack->win);
+    for (t = stack; t && t->snext; t = t->snext)
+        ;
+    for (; t; t = t->sprev)
+        refloated |= adopt_transient(c, t);
+    for (t = clients; t; t = t->next)
+        refloated |= adopt_transient(c, t);
 
-    return stack;
+    if (refloated)
+        update_visibility();
 }
 
 static void
-raise(client_t *c)
+manage_finish(pending_t *p)
 {
-    debug("raise: %x (%x)\n", c, c ? c->win : -1);
-
-    uint16_t mask = 0;
-    xcb_params_configure_window_t params;
-    XCB_AUX_ADD_PARAM(&mask, &params, stack_mode, XCB_STACK_MODE_ABOVE);
-    configure(c->win, mask, &params);
-    focus(c);
+    xcb_window_t w = p->win;
+    xcb_get_window_attributes_reply_t *info = p->replies[PendingAttributes];
+    xcb_get_geometry_reply_t *geom = p->replies[PendingGeometry];
 
-    /* Walk through windows stack from bottom to top, raising the
-     transients. Focus the last raised window */
+    debug("manage_finish: win %x\n", w);
 
-    raise_transients_for(stack, c);
-}
+    if (!info || !geom) {
+        debug("manage_finish: window %x has gone away\n", w);
+        return;
+    }
 
-static void
-manage(xcb_window_t w)
-{
-    debug("manage: win %x\n", w);
+    if (info->override_redirect || getclient(w))
+        return;
 
     client_t *c = xalloc(sizeof(client_t));
     c->win = w;
 
-    xcb_window_t transient_for = get_transient_for(w);
-    client_t *transient_for_client = getclient(transient_for);
-    debug(" transient_for: %x (%x)\n", transient_for_client, transient_for);
-    c->is_floating = transient_for != XCB_NONE && transient_for_client != NULL;
-
-    xcb_get_geometry_reply_t *geom
-        = xcb_get_geometry_reply(conn, xcb_get_geometry(conn, w), NULL);
-    if (!geom)
-        goto err;
+    /* Transient-for client is looked up only now: it might have been
+     * managed while waiting for replies */
+    xcb_window_t transient_for;
+    if (!xcb_get_wm_transient_for_from_reply(&transient_for,
+                                             p->replies[PendingTransientFor]))
+        transient_for = XCB_NONE;
+    settransient(c, transient_for);
+    debug(" transient_for: %x (%x)\n", c->parent, transient_for);
+    c->is_floating = c->parent != NULL;
 
     /* geometry */
-    c->x = geom->x;
-    c->y = geom->y;
-    c->w = geom->width;
-    c->h = geom->height;
-    c->bw = c->oldbw = geom->border_width;
-
-    free(geom);
+    c->x = p->configured & XCB_CONFIG_WINDOW_X ? p->geom.x : geom->x;
+    c->y = p->configured & XCB_CONFIG_WINDOW_Y ? p->geom.y : geom->y;
+    c->w = p->configured & XCB_CONFIG_WINDOW_WIDTH ? p->geom.w : geom->width;
+    c->h = p->configured & XCB_CONFIG_WINDOW_HEIGHT ? p->geom.h : geom->height;
+    c->bw = c->oldbw = p->configured & XCB_CONFIG_WINDOW_BORDER_WIDTH
+        ? p->geom.bw : geom->border_width;
+
+    /* EWMH: _NET_WM_PID is meaningful only along with WM_CLIENT_MACHINE */
+    xcb_get_property_reply_t *pid = p->replies[PendingPid];
+    if (pid && pid->type == CARDINAL && pid->format == 32
+        && xcb_get_property_value_length(pid) >= 4
+        && is_local(p->replies[PendingMachine]))
+        proc_attach(c, *(uint32_t *)xcb_get_property_value(pid));
+
+    set_protocols(c, p->replies[PendingProtocols]);
+    set_hints(c, p->replies[PendingHints]);
+
+    /* Armed timer keeps deferred client out of damage till it is raised,
+     * see damage_visible() */
+    if (map_delay_ms) {
+        raises_deferred++;
+        settimeout(&c->raise_timeout, map_delay_ms, deferred_raise, c);
+    }
 
     arrange(c);
 
     {
         uint32_t mask = 0;
         xcb_params_cw_t params;
+        /* Own StructureNotify duplicates SubstructureNotify of root */
         XCB_AUX_ADD_PARAM(&mask, &params, event_mask,
-                          XCB_EVENT_MASK_ENTER_WINDOW |
                           XCB_EVENT_MASK_FOCUS_CHANGE |
                           XCB_EVENT_MASK_PROPERTY_CHANGE |
-                          XCB_EVENT_MASK_STRUCTURE_NOTIFY);
+                          (minimal_mask ? 0 :
+                           XCB_EVENT_MASK_ENTER_WINDOW |
+                           XCB_EVENT_MASK_STRUCTURE_NOTIFY));
 
-        xcb_void_cookie_t c
-            = xcb_aux_change_window_attributes_checked(conn, w, mask, &params);
+        track(backend->change_window_attributes(conn, w, mask, &params),
+              "select events for window", w, ErrWarn);
+    }
 
-        if (xcb_request_check(conn, c)) {
-            warnx("Unable to select events for window.");
-            goto err;
-        }
+#ifdef XDAMAGE
+    if (repaint_monitor) {
+        c->damage = xcb_generate_id(conn);
+        c->repaint.sec = now_us() / 1000000;
+        track(xcb_damage_create(conn, c->damage, w,
+                                XCB_DAMAGE_REPORT_LEVEL_RAW_RECTANGLES),
+              "monitor repaints of", w, ErrWarn);
     }
+#endif
 
     attach(c);
+    adopt_transients(c);
 
-    debug("manage: attaching %x to a stack\n", c->win);
-    attachstack(c);
-
-    if (xcb_request_check(conn, xcb_map_window_checked(conn, w))) {
-        warnx("manage: unable to map window.");
-        goto err;
+    /* Deferred client gets into focus stack and is damaged only when
+     * raised */
+    if (!map_delay_ms) {
+        debug("manage: attaching %x to a stack\n", c->win);
+        attachstack(c);
+        damage_visible(c, client_rect(c));
     }
 
-    raise(c);
+    /* Failures below are reported asynchronously. If the window has gone
+     * away meanwhile, DestroyNotify will unmanage it. */
+    track(backend->map_window(conn, w), "map window", w, ErrWarn);
+
+    if (!map_delay_ms)
+        raiseclient(c);
 
     debug("manage: win: %x, state: WM_STATE_NORMAL\n", c->win);
-    if (!setclientstate(c, XCB_WM_STATE_NORMAL))
-        goto err;
+    setclientstate(c, XCB_WM_STATE_NORMAL);
+}
 
-    return;
-err:
-    warn("manage: Error while trying to manage window %x", c->win);
-    detach(c);
-    if (stack == c) {
-        detachstack(c);
-        focus(NULL);
-    } else
-        detachstack(c);
-    free(c);
+/*
+ * Finishes managing windows whose replies have arrived. Replies come in
+ * order of requests, so the first missing one means nothing else is ready
+ * yet. Returns true if any pending window has been processed.
+ */
+static bool
+manage_pending()
+{
+    bool progress = false;
+
+    while (pending) {
+        pending_t *p = pending;
+
+        while (p->nreplies < PendingLast) {
+            xcb_generic_error_t *err = NULL;
+            if (!backend->poll_for_reply(conn, p->cookies[p->nreplies],
+                                         &p->replies[p->nreplies], &err))
+                return progress;
+            /* Reply is left NULL if window is not queryable */
+            free(err);
+            p->nreplies++;
+        }
+
+        pending = p->next;
+        if (!pending)
+            pending_tail = &pending;
+
+        if (!p->cancelled) {
+            unsigned long start_us = stats ? now_us() : 0;
+            unsigned long start_roundtrips = roundtrips;
+
+            manage_finish(p);
+
+            if (stats)
+                stats_add(STATS_MANAGE, start_us, start_roundtrips);
+        }
+
+        int i;
+        for (i = 0; i < PendingLast; ++i)
+            free(p->replies[i]);
+        free(p);
+        progress = true;
+    }
+
+    return progress;
 }
 
+/* destroyed tells whether window is gone, not just withdrawn */
 static void
-unmanage(client_t *c)
+unmanage(client_t *c, bool destroyed)
 {
     debug("unmanage: %x (%x)\n", c, c ? c->win : -1);
-    xcb_request_check(conn, xcb_grab_server_checked(conn));
+
+    bool was_deferred = c->raise_timeout.armed;
+    if (was_deferred) {
+        debug("unmanage: %x has gone before being raised\n", c->win);
+        canceltimeout(&c->raise_timeout);
+        raises_suppressed++;
+    }
+    canceltimeout(&c->synthetic_timeout);
+    backend->grab_server(conn);
 
     if (c->bw != c->oldbw) {
         uint16_t mask = 0;
@@ -586,18 +2774,39 @@ unmanage(client_t *c)
         configure(c->win, mask, &params);
     }
 
+    /* Whatever was below the window is exposed, unless it was never
+     * accounted as shown */
+    if (!c->is_iconic && !was_deferred)
+        damage_visible(c, client_rect(c));
+
+    cleartransients(c);
     detach(c);
-    if (stack == c) {
-        detachstack(c);
+    bool was_focused = stack == c;
+    detachstack(c);
+
+    /* Exposed iconified client is mapped again before it can be focused */
+    update_visibility();
+    if (was_focused)
         focus(NULL);
-    }
-    else
-        detachstack(c);
+    proc_detach(c);
+    update_foreground();
+
+    /* EWMH: _NET_WM_STATE is removed when window is withdrawn */
+    if (c->is_obscured)
+        backend->delete_property(conn, c->win, atom[NetWMState]);
 
     setclientstate(c, XCB_WM_STATE_WITHDRAWN);
+
+#ifdef XDAMAGE
+    /* Damage is gone already if window was destroyed */
+    if (c->damage && !destroyed)
+        track(xcb_damage_destroy(conn, c->damage), "stop monitoring repaints of",
+              c->win, ErrIgnore);
+#endif
+
     free(c);
 
-    xcb_request_check(conn, xcb_ungrab_server(conn));
+    backend->ungrab_server(conn);
 }
 
 static void
@@ -605,10 +2814,11 @@ scan()
 {
     debug("scan\n");
 
-    xcb_query_tree_cookie_t c = xcb_query_tree(conn, screen->root);
+    xcb_query_tree_cookie_t c = backend->query_tree(conn, screen->root);
 
     xcb_generic_error_t *err;
-    xcb_query_tree_reply_t *tree = xcb_query_tree_reply(conn, c, &err);
+    roundtrips++;
+    xcb_query_tree_reply_t *tree = backend->query_tree_reply(conn, c, &err);
     if (!tree)
         errx(1, "Unable to query windows hierarchy.");
 
@@ -624,22 +2834,28 @@ scan()
 
     int i;
     for (i = 0; i < len; ++i) {
-        cookies[i] = xcb_get_window_attributes(conn, children[i]);
-        transient_cookies[i] = xcb_get_wm_transient_for(conn, children[i]);
-        hints_cookies[i] = xcb_get_wm_hints(conn, children[i]);
+        cookies[i] = backend->get_window_attributes(conn, children[i]);
+        transient_cookies[i]
+            = backend->get_property(conn, false, children[i],
+                                    WM_TRANSIENT_FOR, WINDOW, 0, 1);
+        hints_cookies[i]
+            = backend->get_property(conn, false, children[i], WM_HINTS,
+                                    WM_HINTS, 0, 9);
     }
 
     int ntransients = 0;
     xcb_window_t *transients = xalloc(len * sizeof(xcb_window_t));
 
+    roundtrips++;
+
     /* Non-transient */
     for (i = 0; i < len; ++i) {
         xcb_get_window_attributes_reply_t *info
-            = xcb_get_window_attributes_reply(conn, cookies[i], NULL);
+            = backend->get_window_attributes_reply(conn, cookies[i], NULL);
         xcb_get_property_reply_t *transient_reply
-            = xcb_get_property_reply(conn, transient_cookies[i], NULL);
+            = backend->get_property_reply(conn, transient_cookies[i], NULL);
         xcb_get_property_reply_t *hints_reply
-            = xcb_get_property_reply(conn, hints_cookies[i], NULL);
+            = backend->get_property_reply(conn, hints_cookies[i], NULL);
 
         debug(" %x: info (%x), transient (%x), hints (%x)\n",
               children[i], info, transient_reply, hints_reply);
@@ -701,46 +2917,125 @@ scan()
     focus(stack);
 }
 
+#ifdef XDAMAGE
+static void
+damagenotify(xcb_damage_notify_event_t *e)
+{
+    client_t *c = getclient(e->drawable);
+    if (c)
+        repaint_add(&c->repaint, e->area.width * e->area.height);
+}
+#endif
+
+static bool
+same_geometry_request(const xcb_configure_request_event_t *a,
+                      const xcb_configure_request_event_t *b)
+{
+    uint16_t m = a->value_mask & CONFIG_GEOMETRY;
+
+    return m == (b->value_mask & CONFIG_GEOMETRY)
+        && (!(m & XCB_CONFIG_WINDOW_X) || a->x == b->x)
+        && (!(m & XCB_CONFIG_WINDOW_Y) || a->y == b->y)
+        && (!(m & XCB_CONFIG_WINDOW_WIDTH) || a->width == b->width)
+        && (!(m & XCB_CONFIG_WINDOW_HEIGHT) || a->height == b->height)
+        && (!(m & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+            || a->border_width == b->border_width);
+}
+
+static bool
+same_rect(xcb_rectangle_t a, xcb_rectangle_t b)
+{
+    return a.x == b.x && a.y == b.y && a.width == b.width
+        && a.height == b.height;
+}
+
+/* Only XRaiseWindow is respected of stacking requests */
+static bool
+is_raise_request(const xcb_configure_request_event_t *e)
+{
+    return e->value_mask & XCB_CONFIG_WINDOW_STACK_MODE
+        && (!(e->value_mask & XCB_CONFIG_WINDOW_SIBLING)
+            || e->sibling == XCB_NONE);
+}
+
+/* Checks whether request repeats the last rejected one, and nothing has
+ * moved the client since */
+static bool
+is_rejected_repeat(client_t *c, const xcb_configure_request_event_t *e)
+{
+    return c->has_rejected && (e->value_mask & CONFIG_GEOMETRY)
+        && same_geometry_request(&c->rejected, e)
+        && same_rect(c->rejected_rect, client_rect(c))
+        && c->rejected_bw == c->bw;
+}
+
 static int
 configurerequest(void *p, xcb_connection_t *conn, xcb_configure_request_event_t *e)
 {
     client_t *c = getclient(e->window);
 
-    if (c) {
-        uint16_t m = 0;
-        xcb_params_configure_window_t p;
-        /* Adjust geometry */
-        if (e->value_mask & XCB_CONFIG_WINDOW_X) {
-            XCB_AUX_ADD_PARAM(&m, &p, x, e->x);
-            c->x = e->x;
-        }
-        if (e->value_mask & XCB_CONFIG_WINDOW_Y) {
-            XCB_AUX_ADD_PARAM(&m, &p, y, e->y);
-            c->y = e->y;
-        }
-        if (e->value_mask & XCB_CONFIG_WINDOW_WIDTH) {
-            XCB_AUX_ADD_PARAM(&m, &p, width, e->width);
-            c->w = e->width;
-        }
-        if (e->value_mask & XCB_CONFIG_WINDOW_HEIGHT) {
-            XCB_AUX_ADD_PARAM(&m, &p, height, e->height);
-            c->h = e->height;
-        }
-        if (e->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) {
-            XCB_AUX_ADD_PARAM(&m, &p, border_width, e->border_width);
-            c->bw = e->border_width;
+    if (c && is_rejected_repeat(c, e)) {
+        debug("configurerequest: %x repeats rejected request\n", c->win);
+        c->configure_requests++;
+        c->configure_cached++;
+        configure_cached++;
+        configure_event_limited(c);
+
+        if (is_raise_request(e))
+            raiseclient(c);
+    } else if (c) {
+        geom_t g = client_geom(c);
+        xcb_rectangle_t old_rect = client_rect(c);
+        int old_bw = c->bw;
+
+        c->configure_requests++;
+
+        /* Desired geometry is requested one, adjusted to layout */
+        if (e->value_mask & XCB_CONFIG_WINDOW_X)
+            g.x = e->x;
+        if (e->value_mask & XCB_CONFIG_WINDOW_Y)
+            g.y = e->y;
+        if (e->value_mask & XCB_CONFIG_WINDOW_WIDTH)
+            g.w = e->width;
+        if (e->value_mask & XCB_CONFIG_WINDOW_HEIGHT)
+            g.h = e->height;
+        if (e->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+            g.bw = e->border_width;
+
+        layout_geom(c, &g);
+        commit_geom(c, &g, true);
+
+        /* Layout has undone the request */
+        c->has_rejected = (e->value_mask & CONFIG_GEOMETRY)
+            && same_rect(old_rect, client_rect(c)) && old_bw == c->bw;
+        if (c->has_rejected) {
+            c->rejected = *e;
+            c->rejected_rect = old_rect;
+            c->rejected_bw = old_bw;
         }
 
-        arrange_updated(c, m, &p);
-
-        /* Respects only XRaiseWindow */
-        if (e->value_mask & XCB_CONFIG_WINDOW_STACK_MODE
-            && (!(e->value_mask & XCB_CONFIG_WINDOW_SIBLING)
-                || e->sibling == XCB_NONE))
-            raise(c);
+        if (is_raise_request(e))
+            raiseclient(c);
     } else {
         /* Not our business, just pass it through */
 
+        /* Window waiting for replies is managed with geometry it is given
+         * now, not the one queried before */
+        pending_t *pw = getpending(e->window);
+        if (pw) {
+            pw->configured |= e->value_mask & CONFIG_GEOMETRY;
+            if (e->value_mask & XCB_CONFIG_WINDOW_X)
+                pw->geom.x = e->x;
+            if (e->value_mask & XCB_CONFIG_WINDOW_Y)
+                pw->geom.y = e->y;
+            if (e->value_mask & XCB_CONFIG_WINDOW_WIDTH)
+                pw->geom.w = e->width;
+            if (e->value_mask & XCB_CONFIG_WINDOW_HEIGHT)
+                pw->geom.h = e->height;
+            if (e->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+                pw->geom.bw = e->border_width;
+        }
+
         /* Note: e->value_mask is passed as is to request */
         xcb_params_configure_window_t params;
         params.x = e->x;
@@ -769,23 +3064,103 @@ configurenotify(void *p, xcb_connection_t *conn, xcb_configure_notify_event_t *e
     return 0;
 }
 
+static void
+cancel_pending(xcb_window_t w)
+{
+    pending_t *p = getpending(w);
+    if (p) {
+        debug("cancel_pending: %x\n", w);
+        p->cancelled = true;
+    }
+}
+
 static int
 destroynotify(void *p, xcb_connection_t *conn, xcb_destroy_notify_event_t *e)
 {
     client_t *c = getclient(e->window);
     if(c)
-        unmanage(c);
+        unmanage(c, true);
+    else
+        cancel_pending(e->window);
     return 0;
 }
 
+/* Checks whether c is a transient of p, directly or not */
+static bool
+is_transient_of(client_t *c, client_t *p)
+{
+    for (c = c->parent; c; c = c->parent)
+        if (c == p)
+            return true;
+    return false;
+}
+
+/* Delay before giving focus back after given number of quick steals */
+static unsigned long
+focus_backoff_ms(unsigned int streak)
+{
+    if (streak < FOCUS_FIGHT_STREAK)
+        return 0;
+    streak = MIN(streak - FOCUS_FIGHT_STREAK, 16);
+    return MIN(FOCUS_BACKOFF_MS << streak, FOCUS_BACKOFF_MAX_MS);
+}
+
+static void
+refocus(void *arg)
+{
+    debug("refocus: %x\n", stack ? stack->win : 0);
+    if (stack)
+        give_focus(stack);
+}
+
 static int
 focusin(void *p, xcb_connection_t *conn, xcb_focus_in_event_t *e)
 {
     debug("focusin: %x\n", e->event);
+    if (!stack || e->event == stack->win)
+        return 0;
+
+    /* Focus moved within the group of top client, or top does not take
+     * focus at all */
+    client_t *c = getclient(e->event);
+    if (c && (is_transient_of(c, stack) || is_transient_of(stack, c)
+              || (!stack->accepts_input && !stack->take_focus))) {
+        debug("focusin: allowing focus on %x\n", e->event);
+        focus_allowed++;
+        return 0;
+    }
+
     /* there are some broken focus acquiring clients */
-    if (stack && e->event != stack->win) {
+    focus_steals++;
+    if (c) {
+        unsigned long now = now_us();
+        unsigned long window_ms
+            = focus_backoff_ms(c->steal_streak) + FOCUS_FIGHT_MS;
+
+        c->steals++;
+        if (now - c->last_steal_us < window_ms * 1000)
+            c->steal_streak++;
+        else
+            c->steal_streak = 0;
+        c->last_steal_us = now;
+    }
+
+    if (!c || c->steal_streak < FOCUS_FIGHT_STREAK) {
         debug("focusin: setting focus back to top of stack: %x\n", stack->win);
-        set_focus(XCB_INPUT_FOCUS_POINTER_ROOT, stack->win);
+        give_focus(stack);
+        return 0;
+    }
+
+    if (c->steal_streak == FOCUS_FIGHT_STREAK) {
+        debug("focusin: %x fights for focus\n", c->win);
+        focus_fights++;
+    }
+
+    /* Backing off, focus is given back once */
+    if (!refocus_timeout.armed) {
+        focus_backoffs++;
+        settimeout(&refocus_timeout, focus_backoff_ms(c->steal_streak),
+                   refocus, NULL);
     }
     return 0;
 }
@@ -793,16 +3168,15 @@ focusin(void *p, xcb_connection_t *conn, xcb_focus_in_event_t *e)
 static int
 maprequest(void *p, xcb_connection_t *conn, xcb_map_request_event_t *e)
 {
-    xcb_get_window_attributes_cookie_t c
-        = xcb_get_window_attributes(conn, e->window);
-    xcb_get_window_attributes_reply_t *i
-        = xcb_get_window_attributes_reply(conn, c, NULL);
+    client_t *c = getclient(e->window);
 
-    if (i && !i->override_redirect)
-        if (!getclient(e->window))
-            manage(e->window);
+    /* ICCCM 4.1.4: mapping iconic window makes it normal again */
+    if (c && c->is_iconic)
+        raiseclient(c);
 
-    free(i);
+    /* override_redirect is checked when replies arrive */
+    if (!c && !getpending(e->window))
+        manage(e->window);
     return 0;
 }
 
@@ -814,7 +3188,7 @@ mapnotify(void *p, xcb_connection_t *conn, xcb_map_notify_event_t *e)
      * done at manage() as window is not visible yet there */
     if (stack && e->window == stack->win) {
         debug("mapnotify: focusing %x\n", e->window);
-        set_focus(XCB_INPUT_FOCUS_POINTER_ROOT, e->window);
+        give_focus(stack);
     } else {
         debug("mapnotify: not focusing %x.\n", stack ? stack->win : -1);
     }
@@ -825,18 +3199,53 @@ mapnotify(void *p, xcb_connection_t *conn, xcb_map_notify_event_t *e)
 static void
 check_refloat(client_t *c)
 {
-    xcb_get_property_cookie_t cookie = xcb_get_wm_transient_for(conn, c->win);
+    xcb_get_property_cookie_t cookie
+        = backend->get_property(conn, false, c->win, WM_TRANSIENT_FOR, WINDOW,
+                                0, 1);
 
+    roundtrips++;
     xcb_get_property_reply_t* transient_reply
-        = xcb_get_property_reply(conn, cookie, NULL);
+        = backend->get_property_reply(conn, cookie, NULL);
 
     xcb_window_t transient_for;
     if (xcb_get_wm_transient_for_from_reply(&transient_for, transient_reply)) {
+        settransient(c, transient_for);
+
         bool oldisfloating = c->is_floating;
-        c->is_floating = getclient(transient_for) != NULL;
-        if (c->is_floating != oldisfloating)
+        c->is_floating = c->parent != NULL;
+        if (c->is_floating != oldisfloating) {
             arrange(c);
+            update_visibility();
+        }
     }
+    free(transient_reply);
+}
+
+static void
+check_protocols(client_t *c)
+{
+    xcb_get_property_cookie_t cookie
+        = backend->get_property(conn, false, c->win, atom[WMProtocols], ATOM,
+                                0, 32);
+
+    roundtrips++;
+    xcb_get_property_reply_t *protocols
+        = backend->get_property_reply(conn, cookie, NULL);
+    set_protocols(c, protocols);
+    free(protocols);
+}
+
+static void
+check_hints(client_t *c)
+{
+    xcb_get_property_cookie_t cookie
+        = backend->get_property(conn, false, c->win, WM_HINTS, WM_HINTS, 0, 9);
+
+    roundtrips++;
+    xcb_get_property_reply_t *hints
+        = backend->get_property_reply(conn, cookie, NULL);
+    set_hints(c, hints);
+    free(hints);
 }
 
 static int
@@ -851,6 +3260,10 @@ propertynotify(void *p, xcb_connection_t *conn, xcb_property_notify_event_t *e)
     if ((c = getclient(e->window))) {
         if (e->atom == WM_TRANSIENT_FOR)
             check_refloat(c);
+        else if (e->atom == atom[WMProtocols])
+            check_protocols(c);
+        else if (e->atom == WM_HINTS)
+            check_hints(c);
     }
     return 0;
 }
@@ -858,12 +3271,243 @@ propertynotify(void *p, xcb_connection_t *conn, xcb_property_notify_event_t *e)
 static int
 unmapnotify(void *p, xcb_connection_t *conn, xcb_unmap_notify_event_t *e)
 {
+    /* Window's own StructureNotify duplicates the one received by root */
+    if (e->event != screen->root)
+        return 0;
+
     client_t *c = getclient(e->window);
-    if (c)
-        unmanage(c);
+    if (c) {
+        /* Synthetic UnmapNotify is ICCCM withdrawal even if iconic */
+        if (c->ignore_unmap && !(e->response_type & 0x80)) {
+            c->ignore_unmap--;
+            return 0;
+        }
+        unmanage(c, false);
+    } else
+        cancel_pending(e->window);
     return 0;
 }
 
+/* Returns window event is about, for events which might be coalesced */
+static xcb_window_t
+event_window(xcb_generic_event_t *e)
+{
+    switch (e->response_type & ~0x80) {
+    case XCB_CONFIGURE_REQUEST:
+        return ((xcb_configure_request_event_t *)e)->window;
+    case XCB_MAP_REQUEST:
+        return ((xcb_map_request_event_t *)e)->window;
+    case XCB_MAP_NOTIFY:
+        return ((xcb_map_notify_event_t *)e)->window;
+    case XCB_UNMAP_NOTIFY:
+        return ((xcb_unmap_notify_event_t *)e)->window;
+    case XCB_DESTROY_NOTIFY:
+        return ((xcb_destroy_notify_event_t *)e)->window;
+    case XCB_PROPERTY_NOTIFY:
+        return ((xcb_property_notify_event_t *)e)->window;
+    default:
+        return XCB_NONE;
+    }
+}
+
+/* Keeps server time of events which carry it, see send_protocol() */
+static void
+note_time(xcb_generic_event_t *e)
+{
+    switch (e->response_type & ~0x80) {
+    case XCB_KEY_PRESS:
+    case XCB_KEY_RELEASE:
+    case XCB_BUTTON_PRESS:
+    case XCB_BUTTON_RELEASE:
+    case XCB_MOTION_NOTIFY:
+    case XCB_ENTER_NOTIFY:
+    case XCB_LEAVE_NOTIFY:
+        last_time = ((xcb_enter_notify_event_t *)e)->time;
+        break;
+    case XCB_PROPERTY_NOTIFY:
+        last_time = ((xcb_property_notify_event_t *)e)->time;
+        break;
+    }
+}
+
+static void
+batch_drop(int i)
+{
+    debug("batch_drop: event %d for %x\n", batch[i]->response_type,
+          event_window(batch[i]));
+    free(batch[i]);
+    batch[i] = NULL;
+}
+
+/*
+ * Merges geometry from ConfigureRequest n into earlier request o for the
+ * same window. Restacking requests are never merged, as they depend on the
+ * order of other windows.
+ */
+static bool
+merge_configure_request(xcb_configure_request_event_t *o,
+                        xcb_configure_request_event_t *n)
+{
+    const uint16_t stacking
+        = XCB_CONFIG_WINDOW_SIBLING | XCB_CONFIG_WINDOW_STACK_MODE;
+
+    if ((o->value_mask | n->value_mask) & stacking)
+        return false;
+
+    if (n->value_mask & XCB_CONFIG_WINDOW_X)
+        o->x = n->x;
+    if (n->value_mask & XCB_CONFIG_WINDOW_Y)
+        o->y = n->y;
+    if (n->value_mask & XCB_CONFIG_WINDOW_WIDTH)
+        o->width = n->width;
+    if (n->value_mask & XCB_CONFIG_WINDOW_HEIGHT)
+        o->height = n->height;
+    if (n->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+        o->border_width = n->border_width;
+    o->value_mask |= n->value_mask;
+    return true;
+}
+
+/* Checks whether event would not be received with UUWM_MINIMAL_MASK */
+static bool
+is_avoidable(xcb_generic_event_t *e)
+{
+    switch (e->response_type & ~0x80) {
+    case XCB_ENTER_NOTIFY:
+    case XCB_LEAVE_NOTIFY:
+        return true;
+    case XCB_PROPERTY_NOTIFY:
+        return ((xcb_property_notify_event_t *)e)->window == screen->root;
+    case XCB_MAP_NOTIFY:
+        return ((xcb_map_notify_event_t *)e)->event != screen->root;
+    case XCB_UNMAP_NOTIFY:
+        return ((xcb_unmap_notify_event_t *)e)->event != screen->root;
+    case XCB_DESTROY_NOTIFY:
+        return ((xcb_destroy_notify_event_t *)e)->event != screen->root;
+    case XCB_CONFIGURE_NOTIFY: {
+        xcb_configure_notify_event_t *ce = (xcb_configure_notify_event_t *)e;
+        return ce->event != screen->root && ce->window != screen->root;
+    }
+    default:
+        return false;
+    }
+}
+
+/*
+ * Adds event to batch, coalescing it with earlier events about the same
+ * window:
+ *  - ConfigureRequests are merged into the earlier one,
+ *  - PropertyNotify supersedes earlier one for the same atom,
+ *  - UnmapNotify cancels earlier MapNotify,
+ *  - DestroyNotify cancels everything earlier but unmapping.
+ */
+static void
+batch_add(xcb_generic_event_t *e)
+{
+    uint8_t type = e->response_type & ~0x80;
+    xcb_window_t w = event_window(e);
+    int i;
+
+    note_time(e);
+
+    if (stats) {
+        stats[type].received++;
+        batch_received++;
+        if (e->response_type && is_avoidable(e)) {
+            batch_avoidable++;
+            avoidable_events++;
+        }
+    }
+
+    for (i = nbatch - 1; w != XCB_NONE && i >= 0; --i) {
+        xcb_generic_event_t *o = batch[i];
+        if (!o || event_window(o) != w)
+            continue;
+        uint8_t otype = o->response_type & ~0x80;
+
+        if (type == XCB_DESTROY_NOTIFY) {
+            if (otype != XCB_UNMAP_NOTIFY && otype != XCB_DESTROY_NOTIFY)
+                batch_drop(i);
+            continue;
+        }
+
+        if (type == XCB_PROPERTY_NOTIFY && otype == XCB_PROPERTY_NOTIFY) {
+            if (((xcb_property_notify_event_t *)o)->atom
+                != ((xcb_property_notify_event_t *)e)->atom)
+                continue;
+            batch_drop(i);
+        } else if (type == XCB_CONFIGURE_REQUEST
+                   && otype == XCB_CONFIGURE_REQUEST) {
+            if (merge_configure_request((xcb_configure_request_event_t *)o,
+                                        (xcb_configure_request_event_t *)e)) {
+                debug("batch_add: merged configure request for %x\n", w);
+                free(e);
+                return;
+            }
+        } else if (type == XCB_UNMAP_NOTIFY && otype == XCB_MAP_NOTIFY)
+            batch_drop(i);
+
+        /* Only the latest event about window is coalesced with */
+        break;
+    }
+
+    batch[nbatch++] = e;
+}
+
+static void
+handle_batch(xcb_event_handlers_t *eh)
+{
+    int i;
+    for (i = 0; i < nbatch; ++i) {
+        xcb_generic_event_t *e = batch[i];
+        if (!e)
+            continue;
+
+        unsigned long start_us = stats ? now_us() : 0;
+        unsigned long start_roundtrips = roundtrips;
+
+        if (e->response_type == 0)
+            handle_error((xcb_generic_error_t *)e);
+#ifdef XDAMAGE
+        else if (repaint_monitor
+                 && (e->response_type & ~0x80) == damage_event)
+            damagenotify((xcb_damage_notify_event_t *)e);
+#endif
+        else
+            xcb_event_handle(eh, e);
+
+        if (stats)
+            stats_add(e->response_type & ~0x80, start_us, start_roundtrips);
+        free(e);
+    }
+    nbatch = 0;
+
+    if (stats) {
+        batches++;
+        if (batch_avoidable == batch_received)
+            avoidable_batches++;
+        batch_received = batch_avoidable = 0;
+    }
+}
+
+/* Returns true if a terminating signal has been received */
+static bool
+read_signals(int sfd)
+{
+    struct signalfd_siginfo si;
+    bool quit = false;
+
+    while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGUSR1)
+            dump_requested = true;
+        else {
+            debug("read_signals: quitting on signal %d\n", si.ssi_signo);
+            quit = true;
+        }
+    }
+    return quit;
+}
+
 static void
 run()
 {
@@ -880,25 +3524,120 @@ run()
     xcb_event_set_property_notify_handler(&eh, propertynotify, NULL);
     xcb_event_set_unmap_notify_handler(&eh, unmapnotify, NULL);
 
+    /* Signals are read from signalfd in main loop, which quits on the
+     * terminating ones so cleanup() can restore the windows */
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGHUP);
+    if (dump_enabled)
+        sigaddset(&sigs, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+    int xfd = xcb_get_file_descriptor(conn);
+    int sfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+    if (sfd == -1 || tfd == -1 || efd == -1)
+        err(1, "unable to set up main loop");
+
+    int fds[] = { xfd, sfd, tfd };
+    int i;
+    for (i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fds[i] };
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, fds[i], &ev) == -1)
+            err(1, "unable to set up main loop");
+    }
+
     xcb_generic_event_t *e;
-    while ((e = xcb_wait_for_event(conn))) {
-        xcb_event_handle(&eh, e);
-        free(e);
+    bool quit = false;
+    while (!quit) {
+        run_timeouts();
+        damage_publish();
+
+        if (dump_requested) {
+            dump_requested = false;
+            if (stats)
+                stats_dump();
+#ifdef XDAMAGE
+            repaint_dump();
+#endif
+#ifdef XRES
+            xres_dump();
+#endif
+        }
+
+        /* Nothing waits for replies anymore, so requests pile up in output
+         * buffer until explicitly sent */
+        xcb_flush(conn);
+
+        /* Reads from connection if there are no queued events */
+        if (!(e = xcb_poll_for_event(conn))) {
+            if (xcb_connection_has_error(conn))
+                break;
+
+            if (manage_pending())
+                continue;
+
+            /* Events might have been read together with replies */
+            if (!(e = xcb_poll_for_queued_event(conn))) {
+                struct epoll_event ev[3];
+                int n;
+
+                arm_timer(tfd);
+                n = epoll_wait(efd, ev, 3, -1);
+                for (i = 0; i < n; ++i)
+                    if (ev[i].data.fd == sfd)
+                        quit = read_signals(sfd);
+                    else if (ev[i].data.fd == tfd) {
+                        uint64_t expirations;
+                        if (read(tfd, &expirations, sizeof(expirations)) == -1
+                            && errno != EAGAIN)
+                            warn("unable to read timer");
+                    }
+                continue;
+            }
+        }
+
+        /* Take everything else which has already been read */
+        do
+            batch_add(e);
+        while (nbatch < BATCH && (e = xcb_poll_for_queued_event(conn)));
+
+        handle_batch(&eh);
+
+        /* Once per batch, so a steady stream of events can't hold back
+         * windows whose replies are here */
+        manage_pending();
     }
+
+    close(efd);
+    close(tfd);
+    close(sfd);
 }
 
 static void
 cleanup()
 {
     debug("cleanup: starting");
-    while (stack)
-        unmanage(stack);
+
+    /* Do not leave hidden windows behind */
+    client_t *c;
+    for (c = clients; c; c = c->next)
+        deiconify(c);
+
+    /* Clients with deferred raise are not in stack yet */
+    while (clients)
+        unmanage(clients, false);
     /* FIXME */
     //XFreeCursor(dpy, cursor);
 
     set_focus(XCB_INPUT_FOCUS_POINTER_ROOT, XCB_INPUT_FOCUS_POINTER_ROOT);
+    xcb_flush(conn);
 }
 
+#ifndef UUWM_NO_MAIN
 int
 main(int argc, char *argv[])
 {
@@ -923,3 +3662,4 @@ main(int argc, char *argv[])
     xcb_disconnect(conn);
     return 0;
 }
+#endif